@@ -8,7 +8,35 @@
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include "adc.h"
+#include "os.h"
+#include "filter.h"
+
+// Timer1 at clk/1024 counts 15.625 times per millisecond
+#define ADC_TIMER_COUNTS(ms) ((uint32_t) (ms) * 125 / 8)
+
+static uint8_t scan_channels[ADC_SCAN_CHANNELS];
+static uint8_t scan_count;
+static uint8_t scan_timed;
+#if OS_PROFILE
+static uint16_t scan_period;
+static uint32_t scan_next;
+#endif
+static volatile uint8_t scan_running = 0;
+static volatile uint8_t scan_index;
+static volatile uint8_t scan_repeat;
+static volatile uint16_t scan_sum;
+
+static uint8_t filter_type[8];
+static uint8_t filter_shift[8];
+static filter_state scan_filters[ADC_SCAN_CHANNELS];
+
+static uint16_t scan_buffer[2][ADC_SCAN_CHANNELS];
+static volatile uint8_t fill_buffer;
+static volatile uint8_t scan_ready;
+static volatile uint16_t scan_overruns;
+static os_semaphore scan_done;
 
 /**
  * Initialize ADC for logger
@@ -30,4 +58,175 @@ uint8_t adc_acquire(uint8_t channel) {
     while (!(ADCSRA & 0b00010000)); // Wait for interrupt flag
     ADCSRA |= 0b00010000; // Clear interrupt flag
     return ADCH;
-}
\ No newline at end of file
+}
+
+/**
+ * Choose the filter for a channel
+ * @param channel Channel number 0-7
+ * @param type One of the FILTER_ types
+ * @param shift Strength of the filter
+ * @return 0 on success, -1 on bad arguments
+ */
+int8_t adc_set_filter(uint8_t channel, uint8_t type, uint8_t shift) {
+    filter_state check;
+    if (channel > 7 || filter_init(&check, type, shift) != 0) {
+        return -1;
+    }
+    filter_type[channel] = type;
+    filter_shift[channel] = shift;
+    return 0;
+}
+
+/**
+ * Start scanning a list of channels from the ADC interrupt
+ * @param channels Channel numbers 0-7 in scan order
+ * @param count Number of channels
+ * @param period_ms Time between scan starts, 0 for back to back scans
+ * @return 0 on success, -1 on bad arguments
+ */
+int8_t adc_scan_start(const uint8_t *channels, uint8_t count, uint16_t period_ms) {
+    uint8_t i;
+    if (count == 0 || count > ADC_SCAN_CHANNELS || ADC_TIMER_COUNTS(period_ms) > 0x10000) {
+        return -1;
+    }
+    adc_scan_stop();
+    for (i = 0; i < count; i++) {
+        scan_channels[i] = channels[i] & 0x07; // Single-ended only
+        filter_init(&scan_filters[i], filter_type[scan_channels[i]], filter_shift[scan_channels[i]]);
+    }
+    scan_count = count;
+    scan_timed = period_ms != 0;
+    scan_index = 0;
+    scan_repeat = 0;
+    scan_sum = 0;
+    fill_buffer = 0;
+    scan_ready = 0;
+    scan_overruns = 0;
+    os_semaphore_init(&scan_done, 0);
+
+    ADMUX = 0b00000000 | scan_channels[0]; // AREF, right-adjusted for all 10 bits
+    scan_running = 1;
+#if OS_PROFILE
+    if (scan_timed) {
+        // Timer 1 belongs to the profiler, so timed scans are started from
+        // adc_scan_wait instead, with a tick of jitter
+        scan_period = period_ms;
+        scan_next = os_get_ticks();
+        ADCSRA = 0b10011111; // Enabled, clear flag, interrupts enabled, clk/128
+        return 0;
+    }
+#endif
+    if (scan_timed) {
+        // Timer1 CTC on OCR1A; compare match B at the same count triggers
+        // the first conversion of each scan with no software in the way
+        TCCR1A = 0;
+        TCCR1B = 0;
+        TCNT1 = 0;
+        OCR1A = ADC_TIMER_COUNTS(period_ms) - 1;
+        OCR1B = ADC_TIMER_COUNTS(period_ms) - 1;
+        TIFR = (1 << OCF1B);
+        SFIOR = (SFIOR & 0x1f) | 0b10100000; // Auto trigger on Timer1 compare match B
+        ADCSRA = 0b10111111; // Enabled, auto trigger, clear flag, interrupts enabled, clk/128
+        TCCR1B = (1 << WGM12) | (1 << CS12) | (1 << CS10); // CTC, clk/1024
+    } else {
+        ADCSRA = 0b11011111; // Enabled, start, clear flag, interrupts enabled, clk/128
+    }
+    return 0;
+}
+
+/**
+ * Stop scanning after the conversion in progress
+ */
+void adc_scan_stop(void) {
+    ENTER_CRITICAL_SECTION();
+    if (scan_running) {
+        scan_running = 0;
+#if !OS_PROFILE
+        if (scan_timed) {
+            // Timer 1 only belongs to the scanner outside profile builds
+            TCCR1B = 0;
+            SFIOR &= 0x1f; // Free running trigger source
+        }
+#endif
+        ADCSRA = 0b10010111; // Back to polled operation
+    }
+    LEAVE_CRITICAL_SECTION();
+}
+
+/**
+ * Block until the next scan completes
+ * @return Samples in channel list order
+ */
+const uint16_t *adc_scan_wait(void) {
+    const uint16_t *samples;
+#if OS_PROFILE
+    if (scan_timed) {
+        uint32_t now = os_get_ticks();
+        if ((int32_t) (scan_next - now) > 0) {
+            os_delay(os_get_current_pid(), scan_next - now);
+        }
+        scan_next += scan_period;
+        ADCSRA |= (1 << ADSC);
+    }
+#endif
+    os_semaphore_wait(&scan_done);
+    ENTER_CRITICAL_SECTION();
+    scan_ready = 0;
+    samples = scan_buffer[fill_buffer ^ 1];
+    LEAVE_CRITICAL_SECTION();
+    return samples;
+}
+
+/**
+ * Get the number of completed scans that nobody waited for
+ * @return Number of scans overwritten before being taken
+ */
+uint16_t adc_scan_overruns(void) {
+    uint16_t overruns;
+    ENTER_CRITICAL_SECTION();
+    overruns = scan_overruns;
+    LEAVE_CRITICAL_SECTION();
+    return overruns;
+}
+
+/**
+ * Accumulate a conversion, repeating the channel while it oversamples, then
+ * filter it and start the next channel, swapping buffers and waking the
+ * consumer at the end of each scan
+ */
+OS_ISR(ADC_vect) {
+    if (!scan_running) {
+        return;
+    }
+    scan_sum += ADCW;
+    if (++scan_repeat < filter_conversions(&scan_filters[scan_index])) {
+        ADCSRA |= (1 << ADSC);
+        return;
+    }
+    scan_buffer[fill_buffer][scan_index] = filter_update(&scan_filters[scan_index], scan_sum);
+    scan_repeat = 0;
+    scan_sum = 0;
+    if (++scan_index < scan_count) {
+        ADMUX = scan_channels[scan_index];
+        ADCSRA |= (1 << ADSC);
+        return;
+    }
+    scan_index = 0;
+    ADMUX = scan_channels[0];
+    fill_buffer ^= 1;
+    if (scan_timed) {
+#if !OS_PROFILE
+        // The trigger fires on a rising flag edge, so clear it for the next
+        TIFR = (1 << OCF1B);
+#endif
+    } else {
+        ADCSRA |= (1 << ADSC);
+    }
+    // One wakeup covers any number of scans; the newest is always handed out
+    if (scan_ready) {
+        scan_overruns++;
+    } else {
+        scan_ready = 1;
+        os_semaphore_signal(&scan_done);
+    }
+}
@@ -7,8 +7,17 @@
  * @date November 13 2012
  */
 
-#ifndef ADC
-#define ADC
+#ifndef ADC_H
+#define ADC_H
+
+#include <inttypes.h>
+
+#include "filter.h"
+
+/**
+ * Most channels a scan can cover
+ */
+#define ADC_SCAN_CHANNELS 8
 
 /**
  * Initialize ADC for logger
@@ -22,4 +31,46 @@ void adc_init(void);
  */
 uint8_t adc_acquire(uint8_t channel);
 
-#endif
\ No newline at end of file
+/**
+ * Choose the filter for a channel, see filter.h. Takes effect at the next
+ * adc_scan_start; channels default to FILTER_NONE.
+ * @param channel Channel number 0-7
+ * @param type One of the FILTER_ types
+ * @param shift Strength of the filter
+ * @return 0 on success, -1 on bad arguments
+ */
+int8_t adc_set_filter(uint8_t channel, uint8_t type, uint8_t shift);
+
+/**
+ * Start scanning a list of channels from the ADC interrupt. Each completed
+ * scan lands in one half of a double buffer and wakes the task waiting in
+ * adc_scan_wait. Polled adc_acquire must not be used while a scan runs.
+ * @param channels Channel numbers 0-7 in scan order, copied
+ * @param count Number of channels, 1 to ADC_SCAN_CHANNELS
+ * @param period_ms Time between scan starts, triggered from Timer1 compare
+ * match B, 1-4194 ms; 0 starts each scan as soon as the last one finishes.
+ * In the OS_PROFILE build Timer 1 is taken, and timed scans are started by
+ * adc_scan_wait on the tick instead.
+ * @return 0 on success, -1 on bad arguments
+ */
+int8_t adc_scan_start(const uint8_t *channels, uint8_t count, uint16_t period_ms);
+
+/**
+ * Stop scanning after the conversion in progress
+ */
+void adc_scan_stop(void);
+
+/**
+ * Block until the next scan completes
+ * @return Filtered 12-bit samples in channel list order, valid until the next
+ * scan completes, after which the following scan starts overwriting them
+ */
+const uint16_t *adc_scan_wait(void);
+
+/**
+ * Get the number of completed scans that nobody waited for
+ * @return Number of scans overwritten before being taken
+ */
+uint16_t adc_scan_overruns(void);
+
+#endif
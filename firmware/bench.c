@@ -0,0 +1,364 @@
+/**
+ * Kernel benchmarks
+ *
+ * Standalone firmware image that times the kernel primitives in tight loops
+ * with Timer 1 running at the CPU clock, and prints one line per primitive
+ * over the USART:
+ *
+ *     BENCH <name> n=<samples> min=<cycles> avg=<cycles> max=<cycles>
+ *
+ * Build with "make bench" and run on hardware or in a simulator.
+ */
+
+#include "os.h"
+#include "usart.h"
+#include "lcd.h"
+#include "filter.h"
+
+#define BENCH_ITERATIONS 256
+#define BENCH_STACK_SIZE 128
+
+/**
+ * Gap between two Timer 1 reads in the interrupt loop that counts as an
+ * interrupt having run in between
+ */
+#define BENCH_ISR_THRESHOLD 32
+
+/**
+ * Busy-loop lengths for the priority inversion scenario: the low task's
+ * critical section, and the much longer run of the medium task that would
+ * delay the high task without priority inheritance
+ */
+#define INVERSION_LOW_SPIN 200
+#define INVERSION_MID_SPIN 2000
+
+#define INVERSION_HIGH_PRIORITY 1
+#define INVERSION_MID_PRIORITY 2
+#define INVERSION_LOW_PRIORITY 3
+
+typedef struct {
+    uint16_t count;
+    uint16_t min;
+    uint16_t max;
+    uint32_t total;
+} bench_result;
+
+static volatile uint16_t bench_start;
+static uint16_t bench_overhead = 0;
+static bench_result switch_result;
+
+static os_semaphore bench_semaphore;
+static os_semaphore switch_semaphore;
+
+static volatile uint8_t switch_task_stack[BENCH_STACK_SIZE];
+static volatile uint8_t dummy_task_stack[BENCH_STACK_SIZE];
+
+static os_mutex inversion_mutex;
+static os_semaphore inversion_high_go;
+static os_semaphore inversion_mid_go;
+static os_semaphore inversion_low_go;
+static volatile uint16_t inversion_start;
+static bench_result inversion_high_result;
+static bench_result inversion_mid_result;
+
+static volatile uint8_t inversion_high_stack[BENCH_STACK_SIZE];
+static volatile uint8_t inversion_mid_stack[BENCH_STACK_SIZE];
+static volatile uint8_t inversion_low_stack[BENCH_STACK_SIZE];
+
+#define BENCH_START() bench_start = TCNT1
+#define BENCH_STOP(result) bench_record((result), TCNT1 - bench_start - bench_overhead)
+
+static void bench_reset(bench_result *result) {
+    result->count = 0;
+    result->min = 0xffff;
+    result->max = 0;
+    result->total = 0;
+}
+
+static void bench_record(bench_result *result, uint16_t cycles) {
+    if (cycles < result->min) {
+        result->min = cycles;
+    }
+    if (cycles > result->max) {
+        result->max = cycles;
+    }
+    result->total += cycles;
+    result->count++;
+}
+
+static void uint32_t_to_ascii(uint32_t num, char *buffer) {
+    char digits[11];
+    uint8_t length = 0;
+    do {
+        digits[length++] = '0' + num % 10;
+        num /= 10;
+    } while (num > 0);
+    while (length > 0) {
+        *buffer++ = digits[--length];
+    }
+    *buffer = '\0';
+}
+
+static void bench_print_field(const char *label, uint32_t value) {
+    char buffer[11];
+    uint32_t_to_ascii(value, buffer);
+    usart_puts_P(label);
+    usart_puts(buffer);
+}
+
+static void bench_print(const char *name, bench_result *result) {
+    usart_puts_P(PSTR("BENCH "));
+    usart_puts_P(name);
+    bench_print_field(PSTR(" n="), result->count);
+    bench_print_field(PSTR(" min="), result->count ? result->min : 0);
+    bench_print_field(PSTR(" avg="), result->count ? result->total / result->count : 0);
+    bench_print_field(PSTR(" max="), result->max);
+    usart_puts_P(PSTR("\r\n"));
+    // Drain the transmit buffer so its interrupt stays out of the next loop
+    usart_flush();
+}
+
+/**
+ * High-priority task woken by the main task through switch_semaphore, timing
+ * signal to wakeup
+ */
+static void switch_task(void) {
+    while (1) {
+        os_semaphore_wait(&switch_semaphore);
+        BENCH_STOP(&switch_result);
+    }
+}
+
+static void dummy_task(void) {
+    while (1) {
+        os_delay(os_get_current_pid(), 1000);
+    }
+}
+
+static void bench_spin(uint16_t count) {
+    volatile uint16_t i;
+    for (i = 0; i < count; i++);
+}
+
+/**
+ * High-priority task of the inversion scenario, timing how long it is kept
+ * from the mutex the low task holds
+ */
+static void inversion_high_task(void) {
+    uint16_t cycles;
+    while (1) {
+        os_semaphore_wait(&inversion_high_go);
+        inversion_start = TCNT1;
+        os_mutex_lock(&inversion_mutex);
+        cycles = TCNT1 - inversion_start;
+        os_mutex_unlock(&inversion_mutex);
+        bench_record(&inversion_high_result, cycles - bench_overhead);
+    }
+}
+
+/**
+ * Medium-priority task, woken while the low task holds the mutex. With
+ * inheritance it only runs once the high task is done.
+ */
+static void inversion_mid_task(void) {
+    uint16_t start;
+    while (1) {
+        os_semaphore_wait(&inversion_mid_go);
+        start = TCNT1;
+        bench_spin(INVERSION_MID_SPIN);
+        bench_record(&inversion_mid_result, TCNT1 - start - bench_overhead);
+    }
+}
+
+/**
+ * Low-priority task: takes the mutex, lets the high task block on it,
+ * wakes the medium task and only then finishes its critical section
+ */
+static void inversion_low_task(void) {
+    while (1) {
+        os_semaphore_wait(&inversion_low_go);
+        os_mutex_lock(&inversion_mutex);
+        os_semaphore_signal(&inversion_high_go);
+        os_semaphore_signal(&inversion_mid_go);
+        bench_spin(INVERSION_LOW_SPIN);
+        os_mutex_unlock(&inversion_mutex);
+    }
+}
+
+int main(void) {
+    bench_result result;
+    uint16_t i;
+    uint8_t pid = 0;
+
+    os_init();
+    usart_init(USART_TRANSMIT);
+    os_semaphore_init(&bench_semaphore, 0);
+    os_semaphore_init(&switch_semaphore, 0);
+    os_add_task(switch_task, switch_task_stack, BENCH_STACK_SIZE, 0, "swch");
+
+    // Timer 1 free running at clk/1
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10);
+
+    // Tick interrupts stay off except while timing the tick itself
+    TIMSK &= ~(1 << OCIE0);
+    os_start_ticker();
+    // Let switch_task block on its semaphore
+    schedule();
+
+    usart_puts_P(PSTR("BENCH begin\r\n"));
+    usart_flush();
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BENCH_START();
+        BENCH_STOP(&result);
+    }
+    bench_overhead = result.min;
+    bench_print(PSTR("overhead"), &result);
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BENCH_START();
+        schedule();
+        BENCH_STOP(&result);
+    }
+    bench_print(PSTR("schedule"), &result);
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BENCH_START();
+        os_yield();
+        BENCH_STOP(&result);
+    }
+    bench_print(PSTR("os_yield"), &result);
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BENCH_START();
+        os_delay(os_get_current_pid(), 0);
+        BENCH_STOP(&result);
+    }
+    bench_print(PSTR("os_delay"), &result);
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BENCH_START();
+        os_semaphore_signal(&bench_semaphore);
+        BENCH_STOP(&result);
+        os_semaphore_wait(&bench_semaphore);
+    }
+    bench_print(PSTR("os_semaphore_signal"), &result);
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        os_semaphore_signal(&bench_semaphore);
+        BENCH_START();
+        os_semaphore_wait(&bench_semaphore);
+        BENCH_STOP(&result);
+    }
+    bench_print(PSTR("os_semaphore_wait"), &result);
+
+    bench_reset(&switch_result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BENCH_START();
+        os_semaphore_signal(&switch_semaphore);
+    }
+    bench_print(PSTR("semaphore_switch"), &switch_result);
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        BENCH_START();
+        pid = os_add_task(dummy_task, dummy_task_stack, BENCH_STACK_SIZE, 1, "dumy");
+        BENCH_STOP(&result);
+        os_remove_task(pid);
+    }
+    bench_print(PSTR("os_add_task"), &result);
+
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        pid = os_add_task(dummy_task, dummy_task_stack, BENCH_STACK_SIZE, 1, "dumy");
+        BENCH_START();
+        os_remove_task(pid);
+        BENCH_STOP(&result);
+    }
+    bench_print(PSTR("os_remove_task"), &result);
+
+    // Priority inversion: the high task's wait for the mutex should cover
+    // the low task's critical section only, never the medium task's run
+    os_mutex_init(&inversion_mutex);
+    os_semaphore_init(&inversion_high_go, 0);
+    os_semaphore_init(&inversion_mid_go, 0);
+    os_semaphore_init(&inversion_low_go, 0);
+    os_add_task(inversion_high_task, inversion_high_stack, BENCH_STACK_SIZE, INVERSION_HIGH_PRIORITY, "invh");
+    os_add_task(inversion_mid_task, inversion_mid_stack, BENCH_STACK_SIZE, INVERSION_MID_PRIORITY, "invm");
+    os_add_task(inversion_low_task, inversion_low_stack, BENCH_STACK_SIZE, INVERSION_LOW_PRIORITY, "invl");
+    // Let all three block on their semaphores
+    schedule();
+    bench_reset(&inversion_high_result);
+    bench_reset(&inversion_mid_result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        os_semaphore_signal(&inversion_low_go);
+    }
+    bench_print(PSTR("mutex_inversion_blocking"), &inversion_high_result);
+    bench_print(PSTR("mutex_inversion_mid_run"), &inversion_mid_result);
+
+    // One character per sample, wrapping along a text row
+    lcd_init();
+    bench_reset(&result);
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        lcd_set_cursor(i % 8, i % 21);
+        BENCH_START();
+        lcd_putch('A' + i % 26);
+        BENCH_STOP(&result);
+    }
+    bench_print(PSTR("lcd_putch"), &result);
+
+    // One output of each ADC filter, fed a ramp so every path is exercised
+    {
+        static const uint8_t filter_types[] = { FILTER_NONE, FILTER_OVERSAMPLE, FILTER_AVERAGE, FILTER_IIR };
+        static const uint8_t filter_shifts[] = { 0, 2, 3, 4 };
+        static const char filter_none_name[] PROGMEM = "filter_none";
+        static const char filter_oversample_name[] PROGMEM = "filter_oversample";
+        static const char filter_average_name[] PROGMEM = "filter_average";
+        static const char filter_iir_name[] PROGMEM = "filter_iir";
+        static const char * const filter_names[] = { filter_none_name, filter_oversample_name, filter_average_name, filter_iir_name };
+        filter_state filter;
+        uint8_t type;
+        for (type = 0; type < sizeof(filter_types); type++) {
+            filter_init(&filter, filter_types[type], filter_shifts[type]);
+            bench_reset(&result);
+            for (i = 0; i < BENCH_ITERATIONS; i++) {
+                BENCH_START();
+                filter_update(&filter, i * filter_conversions(&filter));
+                BENCH_STOP(&result);
+            }
+            bench_print(filter_names[type], &result);
+        }
+    }
+
+    // Time stolen from a tight polling loop by each tick interrupt
+    uint16_t last, now, gap, loop_cycles = 0xffff;
+    bench_reset(&result);
+    TIMSK |= (1 << OCIE0);
+    last = TCNT1;
+    while (result.count < BENCH_ITERATIONS) {
+        now = TCNT1;
+        gap = now - last;
+        last = now;
+        if (gap < loop_cycles) {
+            loop_cycles = gap;
+        } else if (gap > BENCH_ISR_THRESHOLD) {
+            bench_record(&result, gap - loop_cycles);
+        }
+    }
+    TIMSK &= ~(1 << OCIE0);
+    bench_print(PSTR("TIMER0_COMP_vect"), &result);
+
+    usart_puts_P(PSTR("BENCH end\r\n"));
+    while (1) {
+        schedule();
+    }
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/**
+ * 24LC256
+ *
+ * Microchip 24LC256 32 KB I2C EEPROM driver
+ */
+
+#include "eeprom24lc256.h"
+#include "i2c.h"
+#include "os.h"
+
+#define ADDRESS_MASK (EEPROM24LC256_SIZE - 1)
+#define PAGE_MASK (EEPROM24LC256_PAGE_SIZE - 1)
+
+// Two address bytes followed by the buffered page data, sent as one write
+static uint8_t page_buffer[2 + EEPROM24LC256_PAGE_SIZE];
+static uint16_t pending_address;
+static uint8_t pending_length = 0;
+static uint8_t write_in_progress = 0;
+static os_mutex eeprom_mutex;
+
+/**
+ * Initialize driver state, call after i2c_init
+ */
+void eeprom24lc256_init(void) {
+    pending_length = 0;
+    write_in_progress = 0;
+    os_mutex_init(&eeprom_mutex);
+}
+
+/**
+ * Wait for the last write cycle to finish by polling until the device
+ * acknowledges its address
+ * @return Error code
+ */
+static int8_t eeprom24lc256_wait_ready(void) {
+    uint8_t tries;
+    int8_t status;
+    if (!write_in_progress) {
+        return I2C_OK;
+    }
+    for (tries = 0; tries < EEPROM24LC256_POLL_LIMIT; tries++) {
+        status = i2c_transfer(EEPROM24LC256_ADDRESS, 0, 0, 0, 0);
+        if (status != I2C_ERROR_NACK) {
+            if (status == I2C_OK) {
+                write_in_progress = 0;
+            }
+            return status;
+        }
+    }
+    return I2C_ERROR_NACK;
+}
+
+/**
+ * Write the buffered bytes as a single page write
+ * @return Error code
+ */
+static int8_t eeprom24lc256_commit(void) {
+    int8_t status;
+    if (pending_length == 0) {
+        return I2C_OK;
+    }
+    status = eeprom24lc256_wait_ready();
+    if (status != I2C_OK) {
+        return status;
+    }
+    page_buffer[0] = (uint8_t) (pending_address >> 8);
+    page_buffer[1] = (uint8_t) (pending_address & 0xff);
+    status = i2c_transfer(EEPROM24LC256_ADDRESS, page_buffer, 2 + pending_length, 0, 0);
+    pending_length = 0;
+    if (status == I2C_OK) {
+        write_in_progress = 1;
+    }
+    return status;
+}
+
+/**
+ * Read bytes starting at an address, wrapping at the end of the device
+ * @return Error code
+ */
+int8_t eeprom24lc256_read(uint16_t address, uint8_t *data, uint16_t length) {
+    uint8_t address_bytes[2];
+    int8_t status;
+    os_mutex_lock(&eeprom_mutex);
+    // Buffered bytes must reach the device before they can be read back
+    status = eeprom24lc256_commit();
+    if (status == I2C_OK) {
+        status = eeprom24lc256_wait_ready();
+    }
+    while (status == I2C_OK && length > 0) {
+        uint8_t chunk = length > 255 ? 255 : length;
+        address &= ADDRESS_MASK;
+        address_bytes[0] = (uint8_t) (address >> 8);
+        address_bytes[1] = (uint8_t) (address & 0xff);
+        status = i2c_transfer(EEPROM24LC256_ADDRESS, address_bytes, 2, data, chunk);
+        address += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+    os_mutex_unlock(&eeprom_mutex);
+    return status;
+}
+
+/**
+ * Write bytes starting at an address, gathering them into page writes
+ * @return Error code
+ */
+int8_t eeprom24lc256_write(uint16_t address, const uint8_t *data, uint16_t length) {
+    int8_t status = I2C_OK;
+    os_mutex_lock(&eeprom_mutex);
+    while (status == I2C_OK && length > 0) {
+        address &= ADDRESS_MASK;
+        if (pending_length > 0 && address != ((pending_address + pending_length) & ADDRESS_MASK)) {
+            status = eeprom24lc256_commit();
+            if (status != I2C_OK) {
+                break;
+            }
+        }
+        if (pending_length == 0) {
+            pending_address = address;
+        }
+        // Page writes wrap within the page, so stop at its end
+        uint8_t space = EEPROM24LC256_PAGE_SIZE - (address & PAGE_MASK);
+        uint8_t count = length < space ? length : space;
+        uint8_t i;
+        for (i = 0; i < count; i++) {
+            page_buffer[2 + pending_length + i] = data[i];
+        }
+        pending_length += count;
+        address += count;
+        data += count;
+        length -= count;
+        if (((pending_address + pending_length) & PAGE_MASK) == 0) {
+            status = eeprom24lc256_commit();
+        }
+    }
+    os_mutex_unlock(&eeprom_mutex);
+    return status;
+}
+
+/**
+ * Write out any buffered bytes
+ * @return Error code
+ */
+int8_t eeprom24lc256_flush(void) {
+    int8_t status;
+    os_mutex_lock(&eeprom_mutex);
+    status = eeprom24lc256_commit();
+    os_mutex_unlock(&eeprom_mutex);
+    return status;
+}
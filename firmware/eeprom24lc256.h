@@ -0,0 +1,60 @@
+/**
+ * 24LC256
+ *
+ * Microchip 24LC256 32 KB I2C EEPROM driver
+ *
+ * Small sequential writes are gathered into the device's 64-byte page
+ * buffer and written as one page write. Instead of waiting a fixed 5 ms for
+ * each write cycle, the device is polled for an acknowledge before its next
+ * use.
+ */
+
+#ifndef EEPROM24LC256
+#define EEPROM24LC256
+
+#include <inttypes.h>
+
+/**
+ * Device address with A2-A0 tied low, 8-bit form
+ */
+#define EEPROM24LC256_ADDRESS 0xa0
+
+#define EEPROM24LC256_SIZE 32768
+#define EEPROM24LC256_PAGE_SIZE 64
+
+/**
+ * Address probes to try before giving up on a write cycle finishing
+ */
+#define EEPROM24LC256_POLL_LIMIT 100
+
+/**
+ * Initialize driver state, call after i2c_init
+ */
+void eeprom24lc256_init(void);
+
+/**
+ * Read bytes starting at an address, wrapping at the end of the device
+ * @param address Address of the first byte
+ * @param data Destination buffer
+ * @param length Number of bytes to read
+ * @return Error code from the I2C driver
+ */
+int8_t eeprom24lc256_read(uint16_t address, uint8_t *data, uint16_t length);
+
+/**
+ * Write bytes starting at an address. Bytes that continue the previous write
+ * within the same page are buffered until the page fills or is flushed.
+ * @param address Address of the first byte
+ * @param data Bytes to write
+ * @param length Number of bytes to write
+ * @return Error code from the I2C driver
+ */
+int8_t eeprom24lc256_write(uint16_t address, const uint8_t *data, uint16_t length);
+
+/**
+ * Write out any buffered bytes
+ * @return Error code from the I2C driver
+ */
+int8_t eeprom24lc256_flush(void);
+
+#endif
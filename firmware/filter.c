@@ -0,0 +1,98 @@
+/**
+ * Filter
+ *
+ * Integer-only sample filters for the ADC path
+ */
+
+#include "filter.h"
+
+/**
+ * Set up a filter
+ * @return 0 on success, -1 on a bad type or shift
+ */
+int8_t filter_init(filter_state *filter, uint8_t type, uint8_t shift) {
+    switch (type) {
+        case FILTER_NONE:
+            shift = 0;
+            break;
+        case FILTER_OVERSAMPLE:
+            if (shift < 1 || shift > FILTER_OVERSAMPLE_SHIFT_MAX) {
+                return -1;
+            }
+            break;
+        case FILTER_AVERAGE:
+            if (shift > FILTER_AVERAGE_SHIFT_MAX) {
+                return -1;
+            }
+            break;
+        case FILTER_IIR:
+            if (shift > FILTER_IIR_SHIFT_MAX) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+    }
+    filter->type = type;
+    filter->shift = shift;
+    filter->primed = 0;
+    filter->index = 0;
+    filter->accumulator = 0;
+    return 0;
+}
+
+/**
+ * Get the number of conversions summed into each filter input
+ * @return Conversions per input
+ */
+uint8_t filter_conversions(filter_state *filter) {
+    if (filter->type == FILTER_OVERSAMPLE) {
+        return 1 << (filter->shift << 1);
+    }
+    return 1;
+}
+
+/**
+ * Feed a filter
+ * @return Filtered 12-bit sample
+ */
+uint16_t filter_update(filter_state *filter, uint16_t sum) {
+    uint16_t sample;
+    uint8_t i;
+
+    if (filter->type == FILTER_OVERSAMPLE) {
+        // The mean of 4^shift conversions is sum >> 2 * shift; keeping
+        // two of those bits gives 12-bit output
+        return sum >> ((filter->shift << 1) - 2);
+    }
+    sample = sum << 2;
+
+    switch (filter->type) {
+        case FILTER_AVERAGE:
+            // Running sum of the window: at most 8 12-bit samples, which
+            // fits in 15 bits. The window starts full of the first sample.
+            if (!filter->primed) {
+                for (i = 0; i < (1 << filter->shift); i++) {
+                    filter->history[i] = sample;
+                }
+                filter->accumulator = sample << filter->shift;
+                filter->primed = 1;
+            }
+            filter->accumulator += (int16_t) (sample - filter->history[filter->index]);
+            filter->history[filter->index] = sample;
+            filter->index = (filter->index + 1) & ((1 << filter->shift) - 1);
+            return (uint16_t) filter->accumulator >> filter->shift;
+        case FILTER_IIR:
+            // State is the output scaled by 2^shift, at most 20 bits. Taking
+            // state >> shift back out each step loses nothing, so a constant
+            // input is reached exactly instead of stalling short of it.
+            if (!filter->primed) {
+                filter->accumulator = (int32_t) sample << filter->shift;
+                filter->primed = 1;
+            }
+            filter->accumulator += (int16_t) (sample - (uint16_t) (filter->accumulator >> filter->shift));
+            return filter->accumulator >> filter->shift;
+        default:
+            return sample;
+    }
+}
@@ -0,0 +1,78 @@
+/**
+ * Filter
+ *
+ * Integer-only sample filters for the ADC path. Every filter takes 10-bit
+ * conversions and produces 12-bit output, so consumers see one scale
+ * whatever filter a channel uses.
+ *
+ * Rough cycle costs per output at 16 MHz with -Os, estimated by hand rather
+ * than measured; "make bench" prints the real figures:
+ *
+ *     FILTER_NONE        about 20 cycles
+ *     FILTER_OVERSAMPLE  about 25 cycles, plus 4^shift conversions
+ *     FILTER_AVERAGE     about 60 cycles
+ *     FILTER_IIR         about 50 cycles plus 8 per bit of shift
+ */
+
+#ifndef FILTER
+#define FILTER
+
+#include <inttypes.h>
+
+#define FILTER_BITS 12
+
+/**
+ * Filter types
+ *
+ * FILTER_OVERSAMPLE sums 4^shift conversions and decimates them, adding
+ * shift bits of resolution when there is at least an LSB of noise.
+ * FILTER_AVERAGE is a moving average over the last 2^shift outputs.
+ * FILTER_IIR is a first order low-pass, y += (x - y) / 2^shift, with a
+ * time constant of about 2^shift samples. Its state keeps shift fraction
+ * bits, so it settles exactly on a constant input.
+ */
+#define FILTER_NONE 0
+#define FILTER_OVERSAMPLE 1
+#define FILTER_AVERAGE 2
+#define FILTER_IIR 3
+
+#define FILTER_OVERSAMPLE_SHIFT_MAX 3
+#define FILTER_AVERAGE_SHIFT_MAX 3
+#define FILTER_IIR_SHIFT_MAX 8
+
+#define FILTER_AVERAGE_LENGTH (1 << FILTER_AVERAGE_SHIFT_MAX)
+
+typedef struct {
+    uint8_t type;
+    uint8_t shift;
+    uint8_t primed;
+    uint8_t index;
+    int32_t accumulator;
+    uint16_t history[FILTER_AVERAGE_LENGTH];
+} filter_state;
+
+/**
+ * Set up a filter
+ * @param filter Filter state
+ * @param type One of the FILTER_ types
+ * @param shift Strength of the filter, see the filter types
+ * @return 0 on success, -1 on a bad type or shift
+ */
+int8_t filter_init(filter_state *filter, uint8_t type, uint8_t shift);
+
+/**
+ * Get the number of conversions summed into each filter input
+ * @param filter Filter state
+ * @return 4^shift for oversampling, otherwise 1
+ */
+uint8_t filter_conversions(filter_state *filter);
+
+/**
+ * Feed a filter
+ * @param filter Filter state
+ * @param sum Sum of filter_conversions 10-bit conversions
+ * @return Filtered 12-bit sample
+ */
+uint16_t filter_update(filter_state *filter, uint16_t sum);
+
+#endif
@@ -1,4 +1,4 @@
-uint8_t font_5x7_data[] = {
+const uint8_t font_5x7_data[] PROGMEM = {
     0x00, 0x00, 0x00, 0x00, 0x00, // SPACE
     0x00, 0x00, 0x5F, 0x00, 0x00, // !
     0x00, 0x03, 0x00, 0x03, 0x00, // "
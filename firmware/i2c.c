@@ -9,6 +9,33 @@
 
 #include "i2c.h"
 
+/* TWI status codes */
+
+#define TWI_REPEATED_START 0x10
+#define TWI_MT_SLA_NACK 0x20
+#define TWI_MT_DATA_ACK 0x28
+#define TWI_MT_DATA_NACK 0x30
+#define TWI_ARBITRATION_LOST 0x38
+#define TWI_MR_SLA_ACK 0x40
+#define TWI_MR_SLA_NACK 0x48
+#define TWI_MR_DATA_ACK 0x50
+#define TWI_MR_DATA_NACK 0x58
+#define TWI_BUS_ERROR 0x00
+
+/* TWCR commands, each clears TWINT to let the hardware continue */
+
+#define TWI_SEND ((1 << TWINT) | (1 << TWEN) | (1 << TWIE))
+#define TWI_SEND_ACK (TWI_SEND | (1 << TWEA))
+#define TWI_SEND_START (TWI_SEND | (1 << TWSTA))
+#define TWI_SEND_STOP ((1 << TWINT) | (1 << TWEN) | (1 << TWSTO))
+#define TWI_SEND_STOP_START (TWI_SEND_START | (1 << TWSTO))
+
+static i2c_transaction * volatile queue_head = 0;
+static i2c_transaction * volatile queue_tail = 0;
+static uint8_t write_index;
+static uint8_t read_index;
+static uint8_t retries;
+
 /**
  * Initialize I2C for 100 kHz operation
  */
@@ -16,6 +43,160 @@ void i2c_init(void) {
     TWBR = 5;
     TWCR = 0b10000100; // Enable device and clear flags
     TWSR = 0b00000010; // Prescale by 16
+    queue_head = 0;
+    queue_tail = 0;
+}
+
+/**
+ * Reset transfer position for the transaction at the head of the queue
+ */
+static void i2c_begin(void) {
+    write_index = 0;
+    read_index = 0;
+}
+
+/**
+ * Finish the transaction at the head of the queue and start the next one
+ * @param status Result for the finished transaction
+ */
+static void i2c_complete(int8_t status) {
+    i2c_transaction *transaction = queue_head;
+    queue_head = transaction->next;
+    if (queue_head == 0) {
+        queue_tail = 0;
+    }
+    transaction->status = status;
+    retries = 0;
+    if (queue_head != 0) {
+        i2c_begin();
+        TWCR = TWI_SEND_STOP_START;
+    } else {
+        TWCR = TWI_SEND_STOP;
+    }
+    os_semaphore_signal(&transaction->done);
+}
+
+/**
+ * Start over after a bus error or lost arbitration, or give up
+ * @param status Status to report if out of retries
+ * @param command TWCR command that releases the bus and sends a new start
+ */
+static void i2c_retry(int8_t status, uint8_t command) {
+    if (retries < I2C_RETRIES) {
+        retries++;
+        i2c_begin();
+        TWCR = command;
+    } else {
+        i2c_complete(status);
+    }
+}
+
+/**
+ * Queue a transaction to run in the background
+ * @param transaction Transaction, must stay valid until it completes
+ */
+void i2c_submit(i2c_transaction *transaction) {
+    transaction->status = I2C_PENDING;
+    transaction->next = 0;
+    os_semaphore_init(&transaction->done, 0);
+    ENTER_CRITICAL_SECTION();
+    if (queue_head == 0) {
+        queue_head = queue_tail = transaction;
+        retries = 0;
+        i2c_begin();
+        TWCR = TWI_SEND_START;
+    } else {
+        queue_tail->next = transaction;
+        queue_tail = transaction;
+    }
+    LEAVE_CRITICAL_SECTION();
+}
+
+/**
+ * Sleep until a submitted transaction completes
+ * @param transaction Transaction passed to i2c_submit
+ * @return Status code
+ */
+int8_t i2c_wait(i2c_transaction *transaction) {
+    os_semaphore_wait(&transaction->done);
+    return transaction->status;
+}
+
+/**
+ * Run a transaction and sleep until it completes
+ * @return Status code
+ */
+int8_t i2c_transfer(uint8_t address, uint8_t *write_data, uint8_t write_length, uint8_t *read_data, uint8_t read_length) {
+    i2c_transaction transaction;
+    transaction.address = address;
+    transaction.write_data = write_data;
+    transaction.write_length = write_length;
+    transaction.read_data = read_data;
+    transaction.read_length = read_length;
+    i2c_submit(&transaction);
+    return i2c_wait(&transaction);
+}
+
+/**
+ * Step the transaction at the head of the queue through each bus state
+ */
+OS_ISR(TWI_vect) {
+    i2c_transaction *transaction = queue_head;
+    uint8_t status = TWSR & 0xf8;
+
+    if (transaction == 0) {
+        TWCR = TWI_SEND_STOP;
+        return;
+    }
+
+    switch (status) {
+    case I2C_START:
+    case TWI_REPEATED_START:
+        // Write phase first unless there is only reading to do
+        if (write_index < transaction->write_length || transaction->read_length == 0) {
+            TWDR = transaction->address & 0xfe;
+        } else {
+            TWDR = transaction->address | 0x01;
+        }
+        TWCR = TWI_SEND;
+        break;
+    case I2C_MT_SLAVE_ACK:
+    case TWI_MT_DATA_ACK:
+        if (write_index < transaction->write_length) {
+            TWDR = transaction->write_data[write_index++];
+            TWCR = TWI_SEND;
+        } else if (transaction->read_length > 0) {
+            TWCR = TWI_SEND_START;
+        } else {
+            i2c_complete(I2C_OK);
+        }
+        break;
+    case TWI_MR_SLA_ACK:
+        TWCR = transaction->read_length > 1 ? TWI_SEND_ACK : TWI_SEND;
+        break;
+    case TWI_MR_DATA_ACK:
+        transaction->read_data[read_index++] = TWDR;
+        // Acknowledge every byte but the last
+        TWCR = read_index < transaction->read_length - 1 ? TWI_SEND_ACK : TWI_SEND;
+        break;
+    case TWI_MR_DATA_NACK:
+        transaction->read_data[read_index++] = TWDR;
+        i2c_complete(I2C_OK);
+        break;
+    case TWI_MT_SLA_NACK:
+    case TWI_MT_DATA_NACK:
+    case TWI_MR_SLA_NACK:
+        i2c_complete(I2C_ERROR_NACK);
+        break;
+    case TWI_ARBITRATION_LOST:
+        // The other master owns the bus, start again once it is free
+        i2c_retry(I2C_ERROR_ARBITRATION, TWI_SEND_START);
+        break;
+    case TWI_BUS_ERROR:
+    default:
+        i2c_retry(I2C_ERROR_BUS, TWI_SEND_STOP_START);
+        break;
+    }
 }
 
 /**
@@ -37,9 +218,9 @@ int8_t i2c_start(void) {
  */
 int8_t i2c_send_address(uint8_t address) {
     TWDR = address;
-    TWCR |= 0b1000000; // Clear interrupt flag to send
-    while (!(TWCR & 0b1000000)); // Wait for TWINT
-    if ((TWSR && 0xf8) != I2C_MT_SLAVE_ACK) {
+    TWCR = 0b10000100; // Clear interrupt flag to send
+    while (!(TWCR & 0b10000000)); // Wait for TWINT
+    if ((TWSR & 0xf8) != I2C_MT_SLAVE_ACK) {
         return TWSR & 0xf8;
     }
     return 0;
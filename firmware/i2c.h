@@ -3,6 +3,10 @@
  *
  * ATmega I2C interface driver
  *
+ * Transfers are queued as transactions and run by the TWI interrupt, so the
+ * submitting task can sleep until its transaction completes. The polled
+ * functions remain for use while the queue is idle.
+ *
  * @author Jeff Stubler
  * @date November 13 2012
  */
@@ -12,14 +16,68 @@
 
 #include <avr/io.h>
 
+#include "os.h"
+
 #define I2C_START 0x08
 #define I2C_MT_SLAVE_ACK 0x18
 
+/**
+ * Times a transaction is restarted after a bus error or lost arbitration
+ */
+#define I2C_RETRIES 3
+
+/* Transaction status codes */
+
+#define I2C_OK 0
+#define I2C_PENDING 1
+#define I2C_ERROR_NACK -1
+#define I2C_ERROR_BUS -2
+#define I2C_ERROR_ARBITRATION -3
+
+/**
+ * Transaction: writes write_length bytes, then, after a repeated start if
+ * both lengths are non-zero, reads read_length bytes
+ */
+typedef struct i2c_transaction {
+    uint8_t address; // 8-bit form, read/write bit is set by the driver
+    uint8_t *write_data;
+    uint8_t write_length;
+    uint8_t *read_data;
+    uint8_t read_length;
+    volatile int8_t status;
+    os_semaphore done;
+    struct i2c_transaction *next;
+} i2c_transaction;
+
 /**
  * Initialize I2C for 100 kHz operation
  */
 void i2c_init(void);
 
+/**
+ * Queue a transaction to run in the background
+ * @param transaction Transaction, must stay valid until it completes
+ */
+void i2c_submit(i2c_transaction *transaction);
+
+/**
+ * Sleep until a submitted transaction completes
+ * @param transaction Transaction passed to i2c_submit
+ * @return Status code
+ */
+int8_t i2c_wait(i2c_transaction *transaction);
+
+/**
+ * Run a transaction and sleep until it completes
+ * @param address Device address, 8-bit form
+ * @param write_data Bytes to write first
+ * @param write_length Number of bytes to write
+ * @param read_data Buffer for bytes read afterwards
+ * @param read_length Number of bytes to read
+ * @return Status code
+ */
+int8_t i2c_transfer(uint8_t address, uint8_t *write_data, uint8_t write_length, uint8_t *read_data, uint8_t read_length);
+
 /**
  * Send start condition
  * @return Error code
@@ -3,6 +3,7 @@
 #include "lcd.h"
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <string.h>
 
 // LCD <=> AVR connections:
 //
@@ -99,14 +100,86 @@ void lcd_init() {
 }
 
 
+#if LCD_FRAMEBUFFER
+
+// Shadow copy of the display, one byte per column of each 8-pixel page.
+// Drawing only touches RAM; lcd_flush() writes out the columns between
+// dirty_first and dirty_last of each page, letting the controller's
+// Y address auto-increment across them.
+#define LCD_PAGES 8
+#define LCD_COLUMNS 128
+#define DIRTY_NONE 255
+static uint8_t framebuffer[LCD_PAGES][LCD_COLUMNS];
+static uint8_t dirty_first[LCD_PAGES];
+static uint8_t dirty_last[LCD_PAGES];
+
+void lcd_flush() {
+    uint8_t page, column, last;
+    for(page = 0; page < LCD_PAGES; ++page) {
+        if (dirty_first[page] == DIRTY_NONE) continue;
+        column = dirty_first[page];
+        while (column <= dirty_last[page]) {
+            // each chip covers 64 columns; address it once per span
+            uint8_t chip = (column & 0x40) ? 1 : 0;
+            last = chip ? dirty_last[page] : (dirty_last[page] < 64 ? dirty_last[page] : 63);
+            lcd_write_wait(chip, LCD_INST, LCD_YADDR(column));
+            lcd_write_wait(chip, LCD_INST, LCD_XADDR(page));
+            for(; column <= last; ++column) {
+                lcd_write_wait(chip, LCD_DATA, framebuffer[page][column]);
+            }
+        }
+        dirty_first[page] = DIRTY_NONE;
+    }
+}
+
+static void lcd_mark_dirty(uint8_t page, uint8_t column) {
+    if (dirty_first[page] == DIRTY_NONE) {
+        dirty_first[page] = column;
+        dirty_last[page] = column;
+    } else if (column < dirty_first[page]) {
+        dirty_first[page] = column;
+    } else if (column > dirty_last[page]) {
+        dirty_last[page] = column;
+    }
+}
+
+// write a whole column byte straight into the framebuffer
+static void lcd_write_column(uint8_t column, uint8_t page, uint8_t data) {
+    framebuffer[page][column & 0x7F] = data;
+}
+
+#else
+
 #define CACHE_EMPTY 255
 static uint8_t cache_chip = CACHE_EMPTY;
 static uint8_t cache_x;
 static uint8_t cache_y;
 static uint8_t cache_d;
 
+// where the next data write will land; the controller auto-increments the
+// column address after each write, so runs of bytes need no re-addressing.
+static uint8_t addr_chip = CACHE_EMPTY;
+static uint8_t addr_x;
+static uint8_t addr_y;
+
+// write a whole column byte, addressing the controller only when the
+// column does not follow on from the last write
+static void lcd_write_column(uint8_t column, uint8_t page, uint8_t data) {
+    uint8_t chip = (column & 0x40) ? 1 : 0;
+    uint8_t y = column & 0x3F;
+    if (addr_chip != chip || addr_x != page || addr_y != y) {
+        lcd_write_wait(chip, LCD_INST, LCD_YADDR(y));
+        lcd_write_wait(chip, LCD_INST, LCD_XADDR(page));
+        addr_chip = chip;
+        addr_x = page;
+    }
+    lcd_write_wait(chip, LCD_DATA, data);
+    addr_y = (y + 1) & 0x3F;
+}
+
 void lcd_flush() {
     if (cache_chip == CACHE_EMPTY) return;
+    addr_chip = CACHE_EMPTY;
     lcd_write_wait(cache_chip, LCD_INST, LCD_YADDR(cache_y));
     lcd_write_wait(cache_chip, LCD_INST, LCD_XADDR(cache_x));
     lcd_write_wait(cache_chip, LCD_DATA, cache_d);
@@ -123,6 +196,7 @@ void lcd_load(uint8_t chip, uint8_t x, uint8_t y) {
     cache_x = x;
     cache_y = y;
     cache_chip = chip;
+    addr_chip = CACHE_EMPTY;
     
     lcd_write_wait(cache_chip, LCD_INST, LCD_YADDR(cache_y));
     lcd_write_wait(cache_chip, LCD_INST, LCD_XADDR(cache_x));
@@ -132,6 +206,8 @@ void lcd_load(uint8_t chip, uint8_t x, uint8_t y) {
     cache_d = lcd_read(cache_chip, LCD_DATA);
 }
 
+#endif
+
 void lcd_clear() {
     uint8_t x, y;
     for(x = 0; x < 8; ++x) {
@@ -149,9 +225,31 @@ void lcd_clear() {
             lcd_write_wait(1, LCD_DATA, 0);
         }
     }
+#if LCD_FRAMEBUFFER
+    memset(framebuffer, 0, sizeof(framebuffer));
+    memset(dirty_first, DIRTY_NONE, sizeof(dirty_first));
+#else
     cache_chip = CACHE_EMPTY;
+    addr_chip = CACHE_EMPTY;
+#endif
 }
 
+#if LCD_FRAMEBUFFER
+
+void lcd_setbit(uint8_t x, uint8_t y, uint8_t v) {
+    uint8_t page = (y & 0x3F) >> 3;
+    uint8_t column = x & 0x7F;
+    uint8_t mask = 1 << (y & 0x07);
+    if (v) {
+        framebuffer[page][column] |= mask;
+    } else {
+        framebuffer[page][column] &= ~mask;
+    }
+    lcd_mark_dirty(page, column);
+}
+
+#else
+
 void lcd_setbit(uint8_t x, uint8_t y, uint8_t v) {
     uint8_t lcd_chip = (x & 0x40) ? 1 : 0;
     uint8_t lcd_x = (y & 0x3F) >> 3;
@@ -165,6 +263,8 @@ void lcd_setbit(uint8_t x, uint8_t y, uint8_t v) {
     }
 }
 
+#endif
+
 static uint8_t cursor_x;
 static uint8_t cursor_y;
 
@@ -173,16 +273,38 @@ void lcd_set_cursor(uint8_t row, uint8_t col) {
     cursor_y = 8 * row;
 }
 
-void lcd_putch(uint8_t ch) {
+// draw a character at the cursor and advance, without flushing
+static void lcd_drawch(uint8_t ch) {
     uint8_t x, y;
     const uint8_t* chp;
     uint8_t b;
     if (ch < 32) ch = 32;
     if (ch > 128) ch = 128;
     chp = font_5x7_data + 5 * (ch-32);
+    if ((cursor_y & 0x07) == 0) {
+        // page aligned: each font column is exactly one display byte
+        uint8_t page = (cursor_y & 0x3F) >> 3;
+#if LCD_FRAMEBUFFER
+        if (((cursor_x + 5) & 0x7F) < (cursor_x & 0x7F)) {
+            // glyph wraps past column 127; one range per page covers both ends
+            lcd_mark_dirty(page, 0);
+            lcd_mark_dirty(page, 127);
+        } else {
+            lcd_mark_dirty(page, cursor_x & 0x7F);
+            lcd_mark_dirty(page, (cursor_x + 5) & 0x7F);
+        }
+#else
+        lcd_flush();  // the bit cache may hold one of these bytes
+#endif
+        for(x = 0; x < 5; ++x) {
+            lcd_write_column(cursor_x + x, page, pgm_read_byte(chp + x) & 0x7F);
+        }
+        lcd_write_column(cursor_x + 5, page, 0);
+        cursor_x += 6;
+        return;
+    }
     for(x = 0; x < 6; ++x) {
-        //b = pgm_read_byte(chp + x);
-        b = *(chp + x);
+        b = pgm_read_byte(chp + x);
         for(y = 0; y < 8; ++y) {
             if (x < 5 && y < 7) {
                 lcd_setbit(cursor_x + x, cursor_y +y, b & (1<<y));
@@ -192,11 +314,24 @@ void lcd_putch(uint8_t ch) {
         }
     }
     cursor_x += 6;
+}
+
+void lcd_putch(uint8_t ch) {
+    lcd_drawch(ch);
     lcd_flush();
 }
 
 void lcd_putstr(const char* str) {
     while(*str) {
-        lcd_putch(*str++);
+        lcd_drawch(*str++);
     }
+    lcd_flush();
+}
+
+void lcd_putstr_P(const char* str) {
+    uint8_t ch;
+    while((ch = pgm_read_byte(str++))) {
+        lcd_drawch(ch);
+    }
+    lcd_flush();
 }
\ No newline at end of file
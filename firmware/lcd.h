@@ -5,6 +5,13 @@
 
 #include <stdint.h>
 
+/* LCD_FRAMEBUFFER: keep a 1 KB copy of the display in RAM so drawing
+ *                  needs no bus reads and lcd_flush() only writes the
+ *                  columns that changed.  0 keeps the one-byte cache. */
+#ifndef LCD_FRAMEBUFFER
+#define LCD_FRAMEBUFFER 0
+#endif
+
 /* lcd_init(): initialize lcd port directions
  *             enable both display chips
  *             set display line to zero */
@@ -26,7 +33,10 @@ void lcd_set_cursor(uint8_t row, uint8_t col);
 /* lcd_putch(): write an ascii character at the cursor and advance */
 void lcd_putch(uint8_t ch);
 
-/* lcd_putstr(): write a string at the cursor */
+/* lcd_putstr(): write a string at the cursor, flushing once at the end */
 void lcd_putstr(const char* str);
 
+/* lcd_putstr_P(): lcd_putstr() for a string in program memory */
+void lcd_putstr_P(const char* str);
+
 #endif  /* LCD_H__ */
\ No newline at end of file
@@ -2,23 +2,35 @@
 #include "usart.h"
 #include "lcd.h"
 #include "adc.h"
+#include "filter.h"
 #include "i2c.h"
+#include "eeprom24lc256.h"
+#include "sensorlog.h"
 
 #include <stdint.h>
+#include <avr/pgmspace.h>
 
 #define STACK_SIZE 64
 
-os_semaphore lcd_sem;
-os_semaphore btn_sem;
-os_semaphore stt_sem;
-os_semaphore tck_sem;
+// Buttons on port A, also used as the button task's notification bits
+#define BUTTON_START 0b00010000
+#define BUTTON_PAUSE 0b00100000
+#define BUTTON_STOP 0b01000000
+#define BUTTON_MASK (BUTTON_START | BUTTON_PAUSE | BUTTON_STOP)
+#define BUTTON_SAMPLE_TICKS 20
+
+os_mutex lcd_mutex;
+os_mutex stt_mutex;
+os_mutex tck_mutex;
 
 uint8_t state = 0;
 uint8_t ticks = 0;
+uint8_t button_pid;
 
 volatile uint8_t button_task_stack[STACK_SIZE + 64];
 volatile uint8_t uart_task_stack[STACK_SIZE + 64];
 volatile uint8_t adc_task_stack[STACK_SIZE + 64];
+volatile uint8_t log_task_stack[STACK_SIZE + 64];
 
 void uint8_t_to_ascii(uint8_t num, char *buffer) {
     uint8_t hundreds = 0, tens = 0, ones = 0;
@@ -62,153 +74,157 @@ void uart_task(void) {
 	/*usart_init(USART_TRANSMIT | USART_RECEIVE);
 	usart_putc('\f');
 	while (1) {
-        usart_puts("Hello World!\r\n");
+        usart_puts_P(PSTR("Hello World!\r\n"));
         os_delay(os_get_current_pid(), 1000);
     }*/
 }
 
 void adc_task(void) {
+    static const uint8_t channels[] = { 0, 1 }; // Light, temperature
     uint8_t update_time = 0;
     adc_init();
+    adc_set_filter(0, FILTER_IIR, 2);
+    adc_set_filter(1, FILTER_OVERSAMPLE, 2); // 12 bits for temperature
+    adc_scan_start(channels, sizeof(channels), 1000);
     while (1) {
         char light_str[6], temp_str[6], time_str[6];
-        uint8_t light = adc_acquire(0);
-        uint8_t temperature = adc_acquire(1);
+        const uint16_t *samples = adc_scan_wait();
+        sensorlog_append(os_get_ticks(), samples[0], samples[1]);
+        uint8_t light = samples[0] >> 4;
+        uint8_t temperature = samples[1] >> 4;
         uint8_t_to_ascii(light, &(light_str[0]));
         uint8_t_to_ascii(temperature, &(temp_str[0]));
         uint8_t_to_ascii(ticks, &(time_str[0]));
-        os_semaphore_wait(&lcd_sem);
+        os_mutex_lock(&lcd_mutex);
         lcd_set_cursor(0, 0);
-        lcd_putstr("Time: ");
+        lcd_putstr_P(PSTR("Time: "));
         lcd_putstr(time_str);
         lcd_set_cursor(1, 0);
-        lcd_putstr("Light: ");
+        lcd_putstr_P(PSTR("Light: "));
         lcd_putstr(light_str);
         lcd_set_cursor(2, 0);
-        lcd_putstr("Temp: ");
+        lcd_putstr_P(PSTR("Temp: "));
         lcd_putstr(temp_str);
-        os_semaphore_signal(&lcd_sem);
+        os_mutex_unlock(&lcd_mutex);
         
-        os_semaphore_wait(&stt_sem);
+        os_mutex_lock(&stt_mutex);
         if (state) {
             update_time = 1;
         } else {
             update_time = 0;
         }
-        os_semaphore_signal(&stt_sem);
-        os_semaphore_wait(&tck_sem);
+        os_mutex_unlock(&stt_mutex);
+        os_mutex_lock(&tck_mutex);
         if (update_time) {
             ticks++;
         }
-        os_semaphore_signal(&tck_sem);
+        os_mutex_unlock(&tck_mutex);
         
         if (state == 1) {
-            usart_puts("Time: ");
+            usart_puts_P(PSTR("Time: "));
             usart_puts(time_str);
-            usart_puts("\r\n");
-            usart_puts("Light: ");
+            usart_puts_P(PSTR("\r\n"));
+            usart_puts_P(PSTR("Light: "));
             usart_puts(light_str);
-            usart_puts("\r\n");
-            usart_puts("Temperature: ");
+            usart_puts_P(PSTR("\r\n"));
+            usart_puts_P(PSTR("Temperature: "));
             usart_puts(temp_str);
-            usart_puts("\r\n");
+            usart_puts_P(PSTR("\r\n"));
         }
-        
-        os_delay(os_get_current_pid(), 1000);
     }
 }
 
+/**
+ * Sample the buttons from the kernel tick at least BUTTON_SAMPLE_TICKS apart
+ * and notify the button task of presses that held for two samples. Port A
+ * has no pin-change interrupt on the ATmega32; riding on the tick costs no
+ * wakeups of its own, and during tickless idle samples simply come once per
+ * stretched period. The kernel is only entered for an actual press.
+ */
+static void button_sample(void) {
+    static uint8_t last = BUTTON_MASK, stable = BUTTON_MASK;
+    static uint32_t sampled = 0;
+    uint32_t now = os_get_ticks();
+    if (now - sampled < BUTTON_SAMPLE_TICKS) {
+        return;
+    }
+    sampled = now;
+    uint8_t sample = PINA & BUTTON_MASK;
+    if (sample == last) {
+        uint8_t pressed = stable & ~sample; // Buttons pull low
+        stable = sample;
+        if (pressed) {
+            os_notify_from_isr(button_pid, pressed);
+        }
+    }
+    last = sample;
+}
+
 void button_task(void) {
-    uint8_t start = 0, stop = 0, pause = 0;
-    os_semaphore_wait(&btn_sem);
+    uint8_t pressed;
+    button_pid = os_get_current_pid();
     // Port A with no pull ups for buttons, input
-    DDRA &= ~(0b01110000);
-    os_semaphore_signal(&btn_sem);
-    os_semaphore_wait(&lcd_sem);
+    DDRA &= ~BUTTON_MASK;
+    os_set_tick_hook(button_sample);
+    os_mutex_lock(&lcd_mutex);
     lcd_set_cursor(4, 0);
-    lcd_putstr("Stopped");
-    os_semaphore_signal(&lcd_sem);
+    lcd_putstr_P(PSTR("Stopped"));
+    os_mutex_unlock(&lcd_mutex);
     while (1) {
-        os_semaphore_wait(&btn_sem);
-        if (!(PINA & 0b00010000)) {
-            start = 1;
-        } else {
-            start = 0;
-        }
-        if (!(PINA & 0b00100000)) {
-            pause = 1;
-        } else {
-            pause = 0;
-        }
-        if (!(PINA & 0b01000000)) {
-            stop = 1;
-        } else {
-            stop = 0;
-        }
-        os_semaphore_signal(&btn_sem);
+        pressed = os_notify_wait(BUTTON_MASK, OS_NOTIFY_ANY, OS_WAIT_FOREVER);
         
-        if (state == 1 && pause == 1) {
-            os_semaphore_wait(&btn_sem);
-            pause = 0;
-            os_semaphore_signal(&btn_sem);
-            os_semaphore_wait(&stt_sem);
+        if (state == 1 && (pressed & BUTTON_PAUSE)) {
+            os_mutex_lock(&stt_mutex);
             state = 2;
-            os_semaphore_signal(&stt_sem);
-            os_semaphore_wait(&lcd_sem);
+            os_mutex_unlock(&stt_mutex);
+            os_mutex_lock(&lcd_mutex);
             lcd_set_cursor(4, 0);
-            lcd_putstr("Paused ");
-            os_semaphore_signal(&lcd_sem);
+            lcd_putstr_P(PSTR("Paused "));
+            os_mutex_unlock(&lcd_mutex);
         }
         
-        if (start) {
-            os_semaphore_wait(&btn_sem);
-            start = 0;
-            os_semaphore_signal(&btn_sem);
-            os_semaphore_wait(&stt_sem);
+        if (pressed & BUTTON_START) {
+            os_mutex_lock(&stt_mutex);
             state = 1;
-            os_semaphore_signal(&stt_sem);
-            os_semaphore_wait(&lcd_sem);
+            os_mutex_unlock(&stt_mutex);
+            os_mutex_lock(&lcd_mutex);
             lcd_set_cursor(4, 0);
-            lcd_putstr("Running");
-            os_semaphore_signal(&lcd_sem);
+            lcd_putstr_P(PSTR("Running"));
+            os_mutex_unlock(&lcd_mutex);
         }
         
-        if (stop) {
-            os_semaphore_wait(&btn_sem);
-            stop = 0;
-            os_semaphore_signal(&btn_sem);
-            os_semaphore_wait(&stt_sem);
+        if (pressed & BUTTON_STOP) {
+            os_mutex_lock(&stt_mutex);
             state = 0;
-            os_semaphore_signal(&stt_sem);
-            os_semaphore_wait(&lcd_sem);
+            os_mutex_unlock(&stt_mutex);
+            os_mutex_lock(&lcd_mutex);
             lcd_set_cursor(4, 0);
-            lcd_putstr("Stopped");
-            os_semaphore_signal(&lcd_sem);
-            os_semaphore_wait(&tck_sem);
+            lcd_putstr_P(PSTR("Stopped"));
+            os_mutex_unlock(&lcd_mutex);
+            os_mutex_lock(&tck_mutex);
             ticks = 0;
-            os_semaphore_signal(&tck_sem);
+            os_mutex_unlock(&tck_mutex);
         }
-        
-        os_delay(os_get_current_pid(), 50);
     }
 }
 
 int main(void) {
     os_init();
-    os_semaphore_init(&lcd_sem, 1);
-    os_semaphore_init(&btn_sem, 1);
-    os_semaphore_init(&stt_sem, 1);
-    os_semaphore_init(&tck_sem, 1);
-    os_add_task(uart_task, &uart_task_stack[STACK_SIZE + 64], 1, "uart");
-    os_add_task(adc_task, &adc_task_stack[STACK_SIZE + 64], 0, "adc");
-    os_add_task(button_task, &button_task_stack[STACK_SIZE + 64], 2, "btn");
+    os_mutex_init(&lcd_mutex);
+    os_mutex_init(&stt_mutex);
+    os_mutex_init(&tck_mutex);
+    // The logger runs ahead of the init task, so the bus must be ready first
+    i2c_init();
+    eeprom24lc256_init();
+    os_add_task(uart_task, uart_task_stack, sizeof(uart_task_stack), 1, "uart");
+    os_add_task(adc_task, adc_task_stack, sizeof(adc_task_stack), 0, "adc");
+    os_add_task(button_task, button_task_stack, sizeof(button_task_stack), 2, "btn");
+    os_add_task(sensorlog_task, log_task_stack, sizeof(log_task_stack), 3, "log");
     os_start_ticker();
     
-    os_semaphore_wait(&lcd_sem);
+    os_mutex_lock(&lcd_mutex);
     lcd_init();
-    os_semaphore_signal(&lcd_sem);
-    
-    i2c_init();
+    os_mutex_unlock(&lcd_mutex);
     
     usart_init(USART_TRANSMIT | USART_RECEIVE);
     usart_putc('\f');
@@ -216,24 +232,27 @@ int main(void) {
     while(1) {
         char buff[6];
         os_delay(os_get_current_pid(), 2000);
-        /*usart_puts("Start I2C\r\n");
+#if OS_PROFILE
+        profile_dump();
+#endif
+        /*usart_puts_P(PSTR("Start I2C\r\n"));
         int8_t start_ = i2c_start();
         int8_t send_ = i2c_send_address(0xa0);
         i2c_stop();
         if (start_ != 0) {
-            usart_puts("Start error\r\n");
+            usart_puts_P(PSTR("Start error\r\n"));
             uint8_t_to_ascii((uint8_t) start_, &(buff[0]));
             usart_puts(buff);
-            usart_puts("\r\n");
+            usart_puts_P(PSTR("\r\n"));
             
         }
         if (send_ != 0) {
-            usart_puts("Send error\r\n");
+            usart_puts_P(PSTR("Send error\r\n"));
             uint8_t_to_ascii((uint8_t) send_, &(buff[0]));
             usart_puts(buff);
-            usart_puts("\r\n");
+            usart_puts_P(PSTR("\r\n"));
         }
-        usart_puts("Stop I2C\r\n\r\n");*/
+        usart_puts_P(PSTR("Stop I2C\r\n\r\n"));*/
     }
     
     return 0;
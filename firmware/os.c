@@ -11,21 +11,342 @@
 
 typedef struct {
     char name[NAME_SIZE];
-    uint32_t start_timestamp;
+    uint32_t delay_ticks;
     uint16_t stack_pointer;
+    volatile uint8_t *stack_base;
+    uint16_t stack_size;
+    uint8_t priority;
+    uint8_t base_priority;
     uint8_t running;
     uint8_t delayed;
     uint8_t suspended;
     uint8_t semaphore_blocked;
+    uint8_t timed_out;
+    uint8_t notify_bits;
+    uint8_t notify_mask;
+    uint8_t notify_all;
+    uint8_t next_delayed;
+    uint8_t next_ready;
+    uint8_t previous_ready;
+    os_semaphore *blocked_semaphore;
+    os_mutex *blocked_mutex;
+    uint32_t block_timestamp;
+    os_task_stats stats;
 } process_control_block;
 
-static volatile uint8_t priority_buffer[NUMBER_OF_PROCESSES];
 static process_control_block pcb[NUMBER_OF_PROCESSES];
 static volatile uint8_t current_process;
+static uint8_t idle_process;
+static void (*stack_overflow_hook)(uint8_t pid) = 0;
+static void (*tick_hook)(void) = 0;
 static volatile uint16_t quantum_ticks = 0;
+static volatile uint8_t switch_pending = 0;
+
+/**
+ * Depth of OS_ISR handlers running, during which a task woken by the
+ * kernel is switched to on interrupt exit rather than at once
+ */
+volatile uint8_t os_interrupt_nesting = 0;
+
+/**
+ * Nesting depth of os_scheduler_lock. While non-zero, switches that would
+ * preempt the current task are left pending instead.
+ */
+static volatile uint8_t scheduler_lock = 0;
 static volatile uint32_t system_ticks = 0;
 static volatile uint8_t idle_task_stack[IDLE_TASK_STACK_SIZE];
 
+/**
+ * Delta queue of delayed tasks, linked through next_delayed and sorted by
+ * wakeup time. Each delay_ticks is relative to the entry before it, so the
+ * tick only has to decrement the head.
+ */
+static volatile uint8_t delay_head = 0xff;
+
+/* Timer 0 settings, CTC mode with a period of TIMER_COMPARE + 1 counts */
+
+#define TIMER_COMPARE 249
+#define TIMER_TICK_MODE ((1 << WGM01) | (1 << CS01) | (1 << CS00)) // clk/64, 1 ms
+#define TIMER_TICKLESS_MODE ((1 << WGM01) | (1 << CS02) | (1 << CS00)) // clk/1024, 16 ms
+
+#if TICKLESS_IDLE
+static volatile uint8_t tickless_active = 0;
+static uint8_t tickless_fraction; // Fast counts dropped entering tickless mode
+
+static void os_tickless_enter(void);
+static void os_tickless_exit(void);
+#endif
+
+/**
+ * Ready bitmap, one bit per priority level, grouped eight levels to a byte.
+ * A bit in ready_group is set whenever the matching ready_table byte is
+ * non-zero, so the highest-priority ready task is found with two lookups.
+ */
+#define READY_TABLE_SIZE ((NUMBER_OF_PRIORITIES + 7) / 8)
+
+static volatile uint8_t ready_group = 0;
+static volatile uint8_t ready_table[READY_TABLE_SIZE];
+
+/**
+ * Ready tasks of each priority, in circular lists linked through
+ * next_ready and previous_ready. The head runs next and moves on when its
+ * quantum expires; tasks becoming ready join at the tail. A next_ready of
+ * 0xff means the task is on no list.
+ */
+static volatile uint8_t ready_head[NUMBER_OF_PRIORITIES];
+
+static const uint8_t bit_mask_table[8] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80
+};
+
+// Index of lowest set bit for each nibble value (0 is never looked up)
+static const uint8_t lowest_bit_table[16] = {
+	0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
+static uint8_t os_lowest_bit(uint8_t bits) {
+	if (bits & 0x0f) {
+		return lowest_bit_table[bits & 0x0f];
+	}
+	return 4 + lowest_bit_table[bits >> 4];
+}
+
+static void os_set_ready(uint8_t priority) {
+	uint8_t group = priority >> 3;
+	ready_table[group] |= bit_mask_table[priority & 0x07];
+	ready_group |= bit_mask_table[group];
+}
+
+static void os_clear_ready(uint8_t priority) {
+	uint8_t group = priority >> 3;
+	ready_table[group] &= ~bit_mask_table[priority & 0x07];
+	if (ready_table[group] == 0) {
+		ready_group &= ~bit_mask_table[group];
+	}
+}
+
+static uint8_t os_task_is_ready(uint8_t pid) {
+	return pcb[pid].running == 1 && pcb[pid].delayed == 0 && pcb[pid].suspended == 0 && pcb[pid].semaphore_blocked == 0 && pcb[pid].blocked_mutex == 0 && pcb[pid].notify_mask == 0;
+}
+
+static void os_ready_list_insert(uint8_t pid) {
+	uint8_t priority = pcb[pid].priority;
+	uint8_t head = ready_head[priority];
+	if (head == 0xff) {
+		pcb[pid].next_ready = pid;
+		pcb[pid].previous_ready = pid;
+		ready_head[priority] = pid;
+		os_set_ready(priority);
+	} else {
+		uint8_t tail = pcb[head].previous_ready;
+		pcb[pid].next_ready = head;
+		pcb[pid].previous_ready = tail;
+		pcb[tail].next_ready = pid;
+		pcb[head].previous_ready = pid;
+	}
+}
+
+static void os_ready_list_remove(uint8_t pid) {
+	uint8_t priority = pcb[pid].priority;
+	uint8_t next = pcb[pid].next_ready;
+	if (next == 0xff) {
+		return;
+	}
+	if (next == pid) {
+		ready_head[priority] = 0xff;
+		os_clear_ready(priority);
+	} else {
+		uint8_t previous = pcb[pid].previous_ready;
+		pcb[previous].next_ready = next;
+		pcb[next].previous_ready = previous;
+		if (ready_head[priority] == pid) {
+			ready_head[priority] = next;
+		}
+	}
+	pcb[pid].next_ready = 0xff;
+}
+
+/**
+ * Put a task on or take it off its ready list to match its state flags.
+ * Must be called with interrupts disabled whenever one of those flags
+ * changes.
+ */
+static void os_update_ready(uint8_t pid) {
+	if (os_task_is_ready(pid)) {
+		if (pcb[pid].next_ready == 0xff) {
+			os_ready_list_insert(pid);
+		}
+	} else {
+		os_ready_list_remove(pid);
+	}
+}
+
+/**
+ * Move a task to another priority, keeping its place on the ready lists
+ * consistent. Must be called with interrupts disabled.
+ */
+static void os_change_priority(uint8_t pid, uint8_t priority) {
+	if (pcb[pid].priority == priority) {
+		return;
+	}
+	os_ready_list_remove(pid);
+	pcb[pid].priority = priority;
+	os_update_ready(pid);
+}
+
+/**
+ * Insert a task into the delta queue to wake after the given number of ticks
+ */
+static void os_delay_queue_insert(uint8_t pid, uint32_t ticks) {
+	uint8_t previous = 0xff;
+	uint8_t next = delay_head;
+	while (next != 0xff && pcb[next].delay_ticks <= ticks) {
+		ticks -= pcb[next].delay_ticks;
+		previous = next;
+		next = pcb[next].next_delayed;
+	}
+	if (next != 0xff) {
+		pcb[next].delay_ticks -= ticks;
+	}
+	pcb[pid].delay_ticks = ticks;
+	pcb[pid].next_delayed = next;
+	if (previous == 0xff) {
+		delay_head = pid;
+	} else {
+		pcb[previous].next_delayed = pid;
+	}
+}
+
+/**
+ * Unlink a task from the delta queue, handing its remaining ticks to the next
+ */
+static void os_delay_queue_remove(uint8_t pid) {
+	uint8_t previous = 0xff;
+	uint8_t current = delay_head;
+	while (current != 0xff && current != pid) {
+		previous = current;
+		current = pcb[current].next_delayed;
+	}
+	if (current == 0xff) {
+		return;
+	}
+	uint8_t next = pcb[pid].next_delayed;
+	if (next != 0xff) {
+		pcb[next].delay_ticks += pcb[pid].delay_ticks;
+	}
+	if (previous == 0xff) {
+		delay_head = next;
+	} else {
+		pcb[previous].next_delayed = next;
+	}
+	pcb[pid].next_delayed = 0xff;
+}
+
+/**
+ * Advance system time by a number of ticks, waking every delayed task whose
+ * delay runs out along the way
+ * @return 1 if a woken task outranks the current one, otherwise 0
+ */
+static uint8_t os_tick_advance(uint8_t ticks) {
+	uint8_t preempt = 0;
+	system_ticks += ticks;
+	pcb[current_process].stats.run_ticks += ticks;
+	while (delay_head != 0xff) {
+		uint8_t pid = delay_head;
+		if (pcb[pid].delay_ticks > ticks) {
+			pcb[pid].delay_ticks -= ticks;
+			break;
+		}
+		ticks -= (uint8_t) pcb[pid].delay_ticks;
+		delay_head = pcb[pid].next_delayed;
+		pcb[pid].next_delayed = 0xff;
+		pcb[pid].delayed = 0;
+		if (pcb[pid].semaphore_blocked == 1) {
+			// A timed semaphore wait ran out
+			pcb[pid].blocked_semaphore->wait_list[pid] = 0;
+			pcb[pid].semaphore_blocked = 0;
+			pcb[pid].timed_out = 1;
+			pcb[pid].stats.blocked_ticks += system_ticks - pcb[pid].block_timestamp;
+		}
+		if (pcb[pid].notify_mask != 0) {
+			// A notification wait ran out
+			pcb[pid].notify_mask = 0;
+			pcb[pid].stats.blocked_ticks += system_ticks - pcb[pid].block_timestamp;
+		}
+		os_update_ready(pid);
+		if (pcb[pid].priority < pcb[current_process].priority) {
+			preempt = 1;
+		}
+	}
+	return preempt;
+}
+
+/**
+ * Take a task off the ready lists and delay queue and free its PCB. Must be
+ * called with interrupts disabled.
+ */
+static void os_unlink_task(uint8_t pid) {
+	os_ready_list_remove(pid);
+	if (pcb[pid].delayed == 1) {
+		os_delay_queue_remove(pid);
+		pcb[pid].delayed = 0;
+	}
+	pcb[pid].running = 0;
+}
+
+/**
+ * Check the task being switched out for a stack overflow, either a saved
+ * stack pointer inside the canary or a canary byte that has been written.
+ * An overflowed task is reported to the hook and removed, except for the
+ * idle task, which the scheduler cannot run without; that halts instead.
+ */
+static void os_check_stack(uint8_t pid) {
+	volatile uint8_t *base = pcb[pid].stack_base;
+	uint8_t canary_index;
+	uint8_t overflowed;
+	if (base == 0 || pcb[pid].running == 0) {
+		return;
+	}
+	overflowed = pcb[pid].stack_pointer < (uint16_t) base + STACK_CANARY_SIZE - 1;
+	for (canary_index = 0; canary_index < STACK_CANARY_SIZE; canary_index++) {
+		if (base[canary_index] != STACK_PAINT) {
+			overflowed = 1;
+		}
+	}
+	if (overflowed) {
+		if (stack_overflow_hook) {
+			stack_overflow_hook(pid);
+		}
+		if (pid == idle_process) {
+			while (1);
+		}
+		os_unlink_task(pid);
+	}
+}
+
+static void os_mutex_apply_inheritance(void);
+
+/**
+ * Drop the scheduler lock taken by a kernel call that switches away next
+ * anyway, without switching twice
+ */
+static void os_scheduler_unlock_and_yield(void) {
+	scheduler_lock--;
+	os_yield();
+}
+
+/**
+ * Switch to a task that was just woken and outranks the current one: now
+ * from task code, or on the way out of the OS_ISR handler that woke it
+ */
+static void os_reschedule(void) {
+	if (os_interrupt_nesting > 0 || scheduler_lock > 0) {
+		switch_pending = 1;
+	} else {
+		os_yield();
+	}
+}
+
 static void os_terminate_current_task(void) {
 	os_remove_task(os_get_current_pid());
 }
@@ -35,121 +356,190 @@ static void os_idle_task(void) {
 	MCUCR |= (1 << SE);
 	MCUCR &= 0xff - ((1 << SM2) | (1 << SM1) | (1 << SM0));
 	while (1) {
-		asm("sleep");
+		asm volatile("cli");
+		// An interrupt woke a task, switch to it now rather than on the next tick
+		if (switch_pending) {
+			asm volatile("sei");
+			os_yield();
+			continue;
+		}
+#if TICKLESS_IDLE
+		os_tickless_enter();
+#endif
+		asm volatile("sei\n\tsleep\n"); // sei holds off interrupts until after sleep
 	}
 }
 
 void enable_timer(void) {
 	TCNT0 = 0;
-	TCCR0 = (1 << WGM01) | (1 << CS01) | (1 << CS00); /// CTC mode, clk/64
-	OCR0 = 250; // clk/64/250 = clk/16000
+	TCCR0 = TIMER_TICK_MODE;
+	OCR0 = TIMER_COMPARE; // clk/64/250 = clk/16000
 	TIMSK |= (1 << OCIE0);
 }
 
+#if TICKLESS_IDLE
+/**
+ * Stretch the timer period from one tick to TICKLESS_PERIOD_TICKS if nothing
+ * is due to wake before then. Called from the idle task with interrupts off.
+ */
+static void os_tickless_enter(void) {
+	if (tickless_active || (TIFR & (1 << OCF0))) {
+		return; // Let a pending tick be counted at its normal length first
+	}
+	if (delay_head != 0xff && pcb[delay_head].delay_ticks < TICKLESS_PERIOD_TICKS) {
+		return;
+	}
+	// Carry the part of the current tick already elapsed into the slow count,
+	// keeping what does not fit for os_tickless_exit
+	uint8_t counts = TCNT0;
+	tickless_fraction = counts & 0x0f;
+	TCCR0 = TIMER_TICKLESS_MODE;
+	TCNT0 = counts >> 4;
+	tickless_active = 1;
+}
+
+/**
+ * Return to one interrupt per tick after an early wakeup, crediting
+ * system_ticks and the delay queue with the ticks slept so far. The shared
+ * prescaler's phase cannot be read, so each stretch is still off by up to
+ * one slow count (16 fast counts, 64 us) either way, but with no bias, so
+ * the error does not build up over many wakeups.
+ */
+static void os_tickless_exit(void) {
+	uint16_t counts = ((uint16_t) TCNT0 << 4) + tickless_fraction;
+	uint8_t ticks = 0;
+	while (counts > TIMER_COMPARE) {
+		counts -= TIMER_COMPARE + 1;
+		ticks++;
+	}
+	if (TIFR & (1 << OCF0)) {
+		// A whole slow period ran out while interrupts were off
+		TIFR = (1 << OCF0);
+		ticks += TICKLESS_PERIOD_TICKS;
+	}
+	TCCR0 = TIMER_TICK_MODE;
+	TCNT0 = (uint8_t) counts;
+	tickless_active = 0;
+#if OS_PROFILE
+	profile_tick_restart();
+#endif
+	os_tick_advance(ticks);
+}
+#endif
+
 static void os_choose_next_process(void) {
-    int current_priority;
-	for (current_priority = 0; current_priority < NUMBER_OF_PROCESSES; current_priority++) {
-		uint8_t selected_pid = priority_buffer[current_priority];
-		if (selected_pid == 0xff) {
-			continue;
+	os_check_stack(current_process);
+#if TICKLESS_IDLE
+	// Anything that reschedules while idle may be about to run a task
+	if (tickless_active) {
+		os_tickless_exit();
+	}
+#endif
+	// The idle task is always ready, so ready_group is never empty
+	uint8_t group = os_lowest_bit(ready_group);
+	uint8_t priority = (group << 3) + os_lowest_bit(ready_table[group]);
+	uint8_t next_process = ready_head[priority];
+	switch_pending = 0;
+
+	if (next_process != current_process) {
+		// A task that is still ready was preempted, otherwise it gave up the processor
+		if (os_task_is_ready(current_process)) {
+			pcb[current_process].stats.preempted_switches++;
 		} else {
-			if (pcb[selected_pid].running == 1 && pcb[selected_pid].delayed == 0 && pcb[selected_pid].suspended == 0 && pcb[selected_pid].semaphore_blocked == 0) {
-				current_process = selected_pid;
-				break;
-			// TODO: WARNING: After 49 days at 1 kHz system tick increment, delays will not work as system_ticks will have rolled over
-			} else if (pcb[selected_pid].delayed == 1 && system_ticks >= pcb[selected_pid].start_timestamp) {
-				pcb[selected_pid].delayed = 0;
-				current_process = selected_pid;
-				break;
-			}
+			pcb[current_process].stats.voluntary_switches++;
 		}
+		pcb[next_process].stats.switches_in++;
+		current_process = next_process;
 	}
 }
 
-NAKED_FUNCTION(schedule) {
-	asm volatile("push r0\n");
-	asm volatile("in r0, __SREG__\n");
-	asm volatile("cli\n");
-	asm volatile("push r0\n");
-	asm volatile("push r1\n");
-	asm volatile("clr r1\n");
-	asm volatile("push r2\n");
-	asm volatile("push r3\n");
-	asm volatile("push r4\n");
-	asm volatile("push r5\n");
-	asm volatile("push r6\n");
-	asm volatile("push r7\n");
-	asm volatile("push r8\n");
-	asm volatile("push r9\n");
-	asm volatile("push r10\n");
-	asm volatile("push r11\n");
-	asm volatile("push r12\n");
-	asm volatile("push r13\n");
-	asm volatile("push r14\n");
-	asm volatile("push r15\n");
-	asm volatile("push r16\n");
-	asm volatile("push r17\n");
-	asm volatile("push r18\n");
-	asm volatile("push r19\n");
-	asm volatile("push r20\n");
-	asm volatile("push r21\n");
-	asm volatile("push r22\n");
-	asm volatile("push r23\n");
-	asm volatile("push r24\n");
-	asm volatile("push r25\n");
-	asm volatile("push r26\n");
-	asm volatile("push r27\n");
-	asm volatile("push r28\n");
-	asm volatile("push r29\n");
-	asm volatile("push r30\n");
-	asm volatile("push r31\n");
-
+/**
+ * Switch to the task chosen by os_choose_next_process. Entered by a jump
+ * from schedule, os_yield or os_isr_exit with the outgoing task's frame
+ * pushed and tagged on top, and returns into the incoming task through
+ * whichever kind of frame it left behind.
+ */
+void os_switch_context(void) __attribute__ ((naked, used, noinline));
+void os_switch_context(void) {
 	pcb[current_process].stack_pointer = STACK_HIGH << 8 | STACK_LOW;
-	// TODO: Investigate round robbin of different tasks at priority level, ready list for quick context switcher
-
-	/*do {
-		current_process = (current_process + 1) % NUMBER_OF_PROCESSES;
-	} while (pcb[current_process].state == OS_UNINITIALIZED_STATE || pcb[current_process].delay_ticks > 0);*/
 	os_choose_next_process();
-
 	STACK_HIGH = (uint8_t) (pcb[current_process].stack_pointer >> 8);
 	STACK_LOW = (uint8_t) (pcb[current_process].stack_pointer & 0xff);
 
-	asm volatile("pop r31\n");
-	asm volatile("pop r30\n");
-	asm volatile("pop r29\n");
-	asm volatile("pop r28\n");
-	asm volatile("pop r27\n");
-	asm volatile("pop r26\n");
-	asm volatile("pop r25\n");
-	asm volatile("pop r24\n");
-	asm volatile("pop r23\n");
-	asm volatile("pop r22\n");
-	asm volatile("pop r21\n");
-	asm volatile("pop r20\n");
-	asm volatile("pop r19\n");
-	asm volatile("pop r18\n");
-	asm volatile("pop r17\n");
-	asm volatile("pop r16\n");
-	asm volatile("pop r15\n");
-	asm volatile("pop r14\n");
-	asm volatile("pop r13\n");
-	asm volatile("pop r12\n");
-	asm volatile("pop r11\n");
-	asm volatile("pop r10\n");
-	asm volatile("pop r9\n");
-	asm volatile("pop r8\n");
-	asm volatile("pop r7\n");
-	asm volatile("pop r6\n");
-	asm volatile("pop r5\n");
-	asm volatile("pop r4\n");
-	asm volatile("pop r3\n");
-	asm volatile("pop r2\n");
-	asm volatile("pop r1\n");
-	asm volatile("pop r0\n");
-	asm volatile("out __SREG__, r0\n");
-	asm volatile("pop r0\n");
-	asm volatile("ret");
+	asm volatile(
+		"pop r24 \n\t"
+		"cpi r24, %0 \n\t"
+		"brne 1f \n\t"
+		:: "M" (OS_FRAME_YIELD));
+	RESTORE_YIELD_CONTEXT();
+	asm volatile(
+		"ret \n\t"
+		"1: \n\t"
+		"cpi r24, %0 \n\t"
+		"breq 2f \n\t"
+		:: "M" (OS_FRAME_INTERRUPT));
+	RESTORE_CONTEXT();
+	asm volatile("ret \n\t" "2: \n\t");
+	// Saved on interrupt entry, when the I flag was already cleared
+	RESTORE_CONTEXT();
+	asm volatile("reti");
+}
+
+/**
+ * Full context switch, saving every register, for callers that cannot
+ * rely on the calling convention
+ */
+NAKED_FUNCTION(schedule) {
+	SAVE_CONTEXT();
+	asm volatile(
+		"ldi r24, %0 \n\t"
+		"push r24 \n\t"
+		"jmp os_switch_context \n\t"
+		:: "M" (OS_FRAME_FULL));
+}
+
+/**
+ * Common tail of OS_ISR handlers. The interrupted task's full frame is on
+ * its stack, so a pending switch only has to tag it and move on; otherwise
+ * it is popped straight back.
+ */
+void os_isr_exit(void) __attribute__ ((naked, used, noinline));
+void os_isr_exit(void) {
+	os_interrupt_nesting--;
+	if (switch_pending && scheduler_lock == 0) {
+		asm volatile(
+			"ldi r24, %0 \n\t"
+			"push r24 \n\t"
+			"jmp os_switch_context \n\t"
+			:: "M" (OS_FRAME_INTERRUPT));
+	}
+	RESTORE_CONTEXT();
+	asm volatile("reti");
+}
+
+/**
+ * Voluntary context switch from C code. Registers the caller may clobber
+ * anyway are not saved, which leaves a frame of 19 bytes instead of 34.
+ * Inside an OS_ISR body it only pends the switch for os_isr_exit, since
+ * switching from there would leave the nesting count raised in the next
+ * task.
+ */
+NAKED_FUNCTION(os_yield) {
+	asm volatile(
+		"lds r24, %0 \n\t"
+		"tst r24 \n\t"
+		"breq 1f \n\t"
+		"ldi r24, 1 \n\t"
+		"sts %1, r24 \n\t"
+		"ret \n\t"
+		"1: \n\t"
+		:: "i" (&os_interrupt_nesting), "i" (&switch_pending));
+	SAVE_YIELD_CONTEXT();
+	asm volatile(
+		"ldi r24, %0 \n\t"
+		"push r24 \n\t"
+		"jmp os_switch_context \n\t"
+		:: "M" (OS_FRAME_YIELD));
 }
 
 /**
@@ -160,21 +550,42 @@ void os_init(void) {
 	for (pcb_index = 0; pcb_index < NUMBER_OF_PROCESSES; pcb_index++) {
 		pcb[pcb_index].running = 0;
         pcb[pcb_index].delayed = 0;
+        pcb[pcb_index].next_delayed = 0xff;
+        pcb[pcb_index].next_ready = 0xff;
         pcb[pcb_index].suspended = 0;
         pcb[pcb_index].semaphore_blocked = 0;
+        pcb[pcb_index].blocked_semaphore = 0;
+        pcb[pcb_index].notify_bits = 0;
+        pcb[pcb_index].notify_mask = 0;
+        pcb[pcb_index].blocked_mutex = 0;
+        pcb[pcb_index].stack_base = 0;
+        pcb[pcb_index].stack_size = 0;
 		copy_string(pcb[pcb_index].name, NAME_SIZE, "");
 		pcb[pcb_index].stack_pointer = 0;
-		priority_buffer[pcb_index] = 0xff;
 	}
+	for (pcb_index = 0; pcb_index < NUMBER_OF_PRIORITIES; pcb_index++) {
+		ready_head[pcb_index] = 0xff;
+	}
+	for (pcb_index = 0; pcb_index < READY_TABLE_SIZE; pcb_index++) {
+		ready_table[pcb_index] = 0;
+	}
+	ready_group = 0;
+	delay_head = 0xff;
 
 	pcb[0].running = 1;
 	copy_string(pcb[0].name, NAME_SIZE, "init");
 	pcb[0].stack_pointer = STACK_HIGH << 8 | STACK_LOW;
-	priority_buffer[NUMBER_OF_PROCESSES - 2] = 0;
+	pcb[0].priority = NUMBER_OF_PRIORITIES - 2;
+	pcb[0].base_priority = NUMBER_OF_PRIORITIES - 2;
+	os_update_ready(0);
 
 	current_process = 0;
 
-	os_add_task(os_idle_task, &idle_task_stack[IDLE_TASK_STACK_SIZE - 1], NUMBER_OF_PROCESSES - 1, "idle");
+	idle_process = os_add_task(os_idle_task, idle_task_stack, IDLE_TASK_STACK_SIZE, NUMBER_OF_PRIORITIES - 1, "idle");
+
+#if OS_PROFILE
+	profile_init();
+#endif
 
 	enable_timer();
 }
@@ -189,6 +600,8 @@ void os_start_ticker(void) {
 /**
  * Delay task for specified number of ticks
  *
+ * A delay of zero ticks yields to any other ready task of higher priority.
+ *
  * @param pid Process ID to delay
  * @param ticks Number of ticks to delay
  */
@@ -196,12 +609,18 @@ int8_t os_delay(uint8_t pid, uint32_t ticks) {
 	if (pid < 0 || pid >= NUMBER_OF_PROCESSES) {
 		return -1;
 	}
-	uint32_t start_timestamp = system_ticks + ticks;
 	ENTER_CRITICAL_SECTION();
-	pcb[pid].start_timestamp = start_timestamp;
-    pcb[pid].delayed = 1;
+	if (pcb[pid].delayed == 1) {
+		os_delay_queue_remove(pid);
+		pcb[pid].delayed = 0;
+	}
+	if (ticks > 0) {
+		os_delay_queue_insert(pid, ticks);
+		pcb[pid].delayed = 1;
+	}
+	os_update_ready(pid);
 	LEAVE_CRITICAL_SECTION();
-	schedule();
+	os_yield();
 	return 0;
 }
 
@@ -214,36 +633,58 @@ int8_t os_cancel_delay(uint8_t pid) {
         return -1;
     }
     ENTER_CRITICAL_SECTION();
-    pcb[pid].delayed = 0;
+    if (pcb[pid].delayed == 1) {
+        os_delay_queue_remove(pid);
+        pcb[pid].delayed = 0;
+        os_update_ready(pid);
+    }
     LEAVE_CRITICAL_SECTION();
-    schedule();
+    os_yield();
     return 0;
 }
 
 /**
  * Add new task to operating system
  */
-int8_t os_add_task(void (*task)(void), volatile uint8_t *stack, uint8_t priority, char *name) {
-	if (priority < 0 || priority >= NUMBER_OF_PROCESSES) {
+int8_t os_add_task(void (*task)(void), volatile uint8_t *stack, uint16_t stack_size, uint8_t priority, char *name) {
+	if (priority < 0 || priority >= NUMBER_OF_PRIORITIES || stack_size < MINIMUM_STACK_SIZE) {
 		return -1;
 	}
 
-	ENTER_CRITICAL_SECTION();
+	// Paint the whole stack so the high-water mark can be found later
+	memset((uint8_t *) stack, STACK_PAINT, stack_size);
+
+	// No interrupt looks at a PCB until it is marked running, so only other
+	// tasks have to be kept out while it is set up
+	os_scheduler_lock();
 
 	uint8_t current_pcb = 0;
 
-	while (pcb[current_pcb].running == 1) {
+	while (current_pcb < NUMBER_OF_PROCESSES && pcb[current_pcb].running == 1) {
 		current_pcb++;
 	}
 
-	if (priority_buffer[priority] != 0xff || current_pcb >= NUMBER_OF_PROCESSES) {
-		LEAVE_CRITICAL_SECTION();
+	if (current_pcb >= NUMBER_OF_PROCESSES) {
+		os_scheduler_unlock();
 		return -1;
 	}
 
-	pcb[current_pcb].running = 1;
+	pcb[current_pcb].delayed = 0;
+	pcb[current_pcb].next_delayed = 0xff;
+	pcb[current_pcb].next_ready = 0xff;
+	pcb[current_pcb].suspended = 0;
+	pcb[current_pcb].semaphore_blocked = 0;
+	pcb[current_pcb].blocked_semaphore = 0;
+	pcb[current_pcb].notify_bits = 0;
+	pcb[current_pcb].notify_mask = 0;
+	pcb[current_pcb].blocked_mutex = 0;
+	pcb[current_pcb].priority = priority;
+	pcb[current_pcb].base_priority = priority;
+	memset(&pcb[current_pcb].stats, 0, sizeof(os_task_stats));
 	copy_string(pcb[current_pcb].name, NAME_SIZE, name);
-	pcb[current_pcb].stack_pointer = (uint16_t) stack;
+	pcb[current_pcb].stack_base = stack;
+	pcb[current_pcb].stack_size = stack_size;
+	pcb[current_pcb].stack_pointer = (uint16_t) (stack + stack_size - 1);
 
 	// When process returns, call void function to remove process
 	*(uint8_t *)pcb[current_pcb].stack_pointer = (uint8_t) ((uint16_t) os_terminate_current_task & 0xff);
@@ -257,20 +698,23 @@ int8_t os_add_task(void (*task)(void), volatile uint8_t *stack, uint8_t priority
 	*(uint8_t *) pcb[current_pcb].stack_pointer = (uint8_t) ((uint16_t) task >> 8);
 	pcb[current_pcb].stack_pointer--;
 
-	// Register 0
-	*(uint8_t *) pcb[current_pcb].stack_pointer = 0;
-	pcb[current_pcb].stack_pointer--;
-	// SREG, new task starts with interrupts enabled
+	// Start from a yield frame. SREG, new task starts with interrupts enabled
 	*(uint8_t *) pcb[current_pcb].stack_pointer = 0x80;
 	pcb[current_pcb].stack_pointer--;
 
-	// Register 1 to Register 31
-	pcb[current_pcb].stack_pointer -= 31;
+	// Registers 2 to 17, 28 and 29
+	pcb[current_pcb].stack_pointer -= 18;
 
-	priority_buffer[priority] = current_pcb;
+	*(uint8_t *) pcb[current_pcb].stack_pointer = OS_FRAME_YIELD;
+	pcb[current_pcb].stack_pointer--;
 
+	ENTER_CRITICAL_SECTION();
+	pcb[current_pcb].running = 1;
+	os_update_ready(current_pcb);
 	LEAVE_CRITICAL_SECTION();
 
+	os_scheduler_unlock();
+
 	return current_pcb;
 }
 
@@ -278,19 +722,13 @@ int8_t os_add_task(void (*task)(void), volatile uint8_t *stack, uint8_t priority
  * Remove a task from running
  */
 int8_t os_remove_task(uint8_t pid) {
-	int current_priority;
-	if (pid < 0 || pid >= NUMBER_OF_PROCESSES) {
+	if (pid < 0 || pid >= NUMBER_OF_PROCESSES || pid == idle_process) {
 		return -1;
 	}
 	ENTER_CRITICAL_SECTION();
-	pcb[pid].running = 0;
-	for (current_priority = 0; current_priority < NUMBER_OF_PROCESSES; current_priority++) {
-		if (priority_buffer[current_priority] == pid) {
-			priority_buffer[current_priority] = 0xff;
-		}
-	}
+	os_unlink_task(pid);
 	LEAVE_CRITICAL_SECTION();
-	schedule();
+	os_yield();
 	return 0;
 }
 
@@ -301,6 +739,24 @@ uint8_t os_get_current_pid(void) {
 	return current_process;
 }
 
+void os_scheduler_lock(void) {
+	scheduler_lock++;
+}
+
+void os_scheduler_unlock(void) {
+	if (scheduler_lock > 0 && --scheduler_lock == 0 && switch_pending) {
+		os_yield();
+	}
+}
+
+uint32_t os_get_ticks(void) {
+	uint32_t ticks;
+	ENTER_CRITICAL_SECTION();
+	ticks = system_ticks;
+	LEAVE_CRITICAL_SECTION();
+	return ticks;
+}
+
 // TODO: Add destination buffer size and do not overwrite it
 void copy_string(char *destination, uint8_t destination_size, char *source) {
 	char *original_destination = destination;
@@ -323,38 +779,36 @@ char *os_get_task_name(uint8_t pid) {
 }
 
 int8_t os_set_task_priority(uint8_t pid, uint8_t priority) {
-	if (priority < 0 || priority >= NUMBER_OF_PROCESSES || pid < 0 || pid >= NUMBER_OF_PROCESSES) {
+	if (priority < 0 || priority >= NUMBER_OF_PRIORITIES || pid < 0 || pid >= NUMBER_OF_PROCESSES) {
 		return -1;
 	}
-	ENTER_CRITICAL_SECTION();
-	uint8_t old_priority = os_get_task_priority(pid);
-	if (priority_buffer[priority] == 0xff) {
-		priority_buffer[priority] = pid;
-		priority_buffer[old_priority] = 0xff;
+	os_scheduler_lock();
+	if (pcb[pid].running == 1) {
+		pcb[pid].base_priority = priority;
+		// Keeps any priority the task has inherited until it unlocks
+		os_mutex_apply_inheritance();
 	}
-	LEAVE_CRITICAL_SECTION();
-	schedule();
+	os_scheduler_unlock_and_yield();
 	return 0;
 }
 
 int8_t os_get_task_priority(uint8_t pid) {
-	int current_priority;
-	for (current_priority = 0; current_priority < NUMBER_OF_PROCESSES; current_priority++) {
-		if (priority_buffer[current_priority] == pid) {
-			return current_priority;
-		}
+	if (pid < 0 || pid >= NUMBER_OF_PROCESSES || pcb[pid].running == 0) {
+		return -1;
 	}
-	return -1;
+	return pcb[pid].priority;
 }
 
 int8_t os_suspend_task(uint8_t pid) {
-	if (pid < 0 || pid >= NUMBER_OF_PROCESSES) {
+	// The scheduler relies on idle always being ready
+	if (pid < 0 || pid >= NUMBER_OF_PROCESSES || pid == idle_process) {
 		return -1;
 	}
 	ENTER_CRITICAL_SECTION();
 	pcb[pid].suspended = 1;
+	os_update_ready(pid);
 	LEAVE_CRITICAL_SECTION();
-	schedule();
+	os_yield();
 	return 0;
 }
 
@@ -364,10 +818,59 @@ int8_t os_resume_task(uint8_t pid) {
 	}
 	ENTER_CRITICAL_SECTION();
 	pcb[pid].suspended = 0;
+	os_update_ready(pid);
+	LEAVE_CRITICAL_SECTION();
+	return 0;
+}
+
+int8_t os_get_task_stats(uint8_t pid, os_task_stats *stats) {
+	if (pid < 0 || pid >= NUMBER_OF_PROCESSES || pcb[pid].running == 0) {
+		return -1;
+	}
+	ENTER_CRITICAL_SECTION();
+	*stats = pcb[pid].stats;
 	LEAVE_CRITICAL_SECTION();
 	return 0;
 }
 
+uint8_t os_get_idle_percentage(void) {
+	ENTER_CRITICAL_SECTION();
+	uint32_t idle_ticks = pcb[idle_process].stats.run_ticks;
+	uint32_t total_ticks = system_ticks;
+	LEAVE_CRITICAL_SECTION();
+	if (total_ticks == 0) {
+		return 0;
+	}
+	// Scale both down together so idle_ticks * 100 cannot overflow
+	while (idle_ticks > 0xffffffffUL / 100) {
+		idle_ticks >>= 1;
+		total_ticks >>= 1;
+	}
+	return idle_ticks * 100 / total_ticks;
+}
+
+uint16_t os_get_stack_high_water(uint8_t pid) {
+	if (pid < 0 || pid >= NUMBER_OF_PROCESSES || pcb[pid].running == 0 || pcb[pid].stack_base == 0) {
+		return 0;
+	}
+	volatile uint8_t *base = pcb[pid].stack_base;
+	uint16_t unused = 0;
+	while (unused < pcb[pid].stack_size && base[unused] == STACK_PAINT) {
+		unused++;
+	}
+	return pcb[pid].stack_size - unused;
+}
+
+void os_set_stack_overflow_hook(void (*hook)(uint8_t pid)) {
+	stack_overflow_hook = hook;
+}
+
+void os_set_tick_hook(void (*hook)(void)) {
+	ENTER_CRITICAL_SECTION();
+	tick_hook = hook;
+	LEAVE_CRITICAL_SECTION();
+}
+
 void os_semaphore_init(os_semaphore *semaphore, uint8_t count) {
     semaphore->count = count;
     uint8_t pid;
@@ -377,50 +880,427 @@ void os_semaphore_init(os_semaphore *semaphore, uint8_t count) {
 }
 
 int8_t os_semaphore_wait(os_semaphore *semaphore) {
+    return os_semaphore_wait_timeout(semaphore, OS_WAIT_FOREVER);
+}
+
+int8_t os_semaphore_wait_timeout(os_semaphore *semaphore, uint32_t ticks) {
     ENTER_CRITICAL_SECTION();
     if (semaphore->count > 0) {
         semaphore->count--;
         LEAVE_CRITICAL_SECTION();
         return 0;
     }
+    // Interrupt handlers may only take a unit that is already there
+    if (ticks == 0 || os_interrupt_nesting > 0) {
+        LEAVE_CRITICAL_SECTION();
+        return -1;
+    }
     uint8_t pid = os_get_current_pid();
     semaphore->wait_list[pid] = 1;
     pcb[pid].semaphore_blocked = 1;
+    pcb[pid].blocked_semaphore = semaphore;
+    pcb[pid].timed_out = 0;
+    pcb[pid].block_timestamp = system_ticks;
+    if (ticks != OS_WAIT_FOREVER) {
+        os_delay_queue_insert(pid, ticks);
+        pcb[pid].delayed = 1;
+    }
+    os_update_ready(pid);
     LEAVE_CRITICAL_SECTION();
-    schedule();
-    ENTER_CRITICAL_SECTION_AGAIN();
-    semaphore->count--;
+    // The signalling task hands the unit over directly, so there is
+    // nothing left to take once this returns unless the wait timed out
+    os_yield();
+    return pcb[pid].timed_out ? -1 : 0;
+}
+
+int8_t os_semaphore_signal(os_semaphore *semaphore) {
+    ENTER_CRITICAL_SECTION();
+    uint8_t pid, waiter = 0xff;
+    for (pid = 0; pid < NUMBER_OF_PROCESSES; pid++) {
+        if (semaphore->wait_list[pid] == 0) {
+            continue;
+        }
+        if (pcb[pid].running == 0 || pcb[pid].semaphore_blocked == 0 || pcb[pid].blocked_semaphore != semaphore) {
+            // Left behind by a task removed while it was waiting
+            semaphore->wait_list[pid] = 0;
+        } else if (waiter == 0xff || pcb[pid].priority < pcb[waiter].priority) {
+            waiter = pid;
+        }
+    }
+    if (waiter != 0xff) {
+        semaphore->wait_list[waiter] = 0;
+        pcb[waiter].semaphore_blocked = 0;
+        if (pcb[waiter].delayed == 1) {
+            os_delay_queue_remove(waiter);
+            pcb[waiter].delayed = 0;
+        }
+        pcb[waiter].stats.blocked_ticks += system_ticks - pcb[waiter].block_timestamp;
+        os_update_ready(waiter);
+        uint8_t preempt = pcb[waiter].priority < pcb[current_process].priority;
+        LEAVE_CRITICAL_SECTION();
+        if (preempt) {
+            os_reschedule();
+        }
+        return 0;
+    }
+    if (semaphore->count < 255) {
+        semaphore->count++;
+        LEAVE_CRITICAL_SECTION();
+        return 0;
+    }
     LEAVE_CRITICAL_SECTION();
+    return -1;
+}
+
+/**
+ * Bits of a notification mask that satisfy a wait, all of them or nothing
+ * when waiting for all
+ */
+static uint8_t os_notify_matched(uint8_t pid, uint8_t mask, uint8_t all) {
+    uint8_t matched = pcb[pid].notify_bits & mask;
+    if (all && matched != mask) {
+        return 0;
+    }
+    return matched;
+}
+
+/**
+ * Set notification bits and wake the task if that satisfies its wait. Must
+ * be called with interrupts disabled.
+ * @return 1 if the woken task outranks the current one, otherwise 0
+ */
+static uint8_t os_notify_set(uint8_t pid, uint8_t bits) {
+    pcb[pid].notify_bits |= bits;
+    if (pcb[pid].notify_mask == 0 || os_notify_matched(pid, pcb[pid].notify_mask, pcb[pid].notify_all) == 0) {
+        return 0;
+    }
+    pcb[pid].notify_mask = 0;
+    if (pcb[pid].delayed == 1) {
+        os_delay_queue_remove(pid);
+        pcb[pid].delayed = 0;
+    }
+    pcb[pid].stats.blocked_ticks += system_ticks - pcb[pid].block_timestamp;
+    os_update_ready(pid);
+    return pcb[pid].priority < pcb[current_process].priority;
+}
+
+int8_t os_notify(uint8_t pid, uint8_t bits) {
+    if (pid >= NUMBER_OF_PROCESSES || pcb[pid].running == 0) {
+        return -1;
+    }
+    ENTER_CRITICAL_SECTION();
+    uint8_t preempt = os_notify_set(pid, bits);
+    LEAVE_CRITICAL_SECTION();
+    if (preempt) {
+        os_reschedule();
+    }
     return 0;
 }
 
-int8_t os_semaphore_signal(os_semaphore *semaphore) {
-        ENTER_CRITICAL_SECTION();
-        if (semaphore->count == 0) {
-            uint8_t pid;
-            for (pid = 0; pid < NUMBER_OF_PROCESSES; pid++) {
-                pcb[pid].semaphore_blocked = 0;
-                semaphore->wait_list[pid] = 0;
-            }
-            LEAVE_CRITICAL_SECTION();
-            schedule();
-            ENTER_CRITICAL_SECTION_AGAIN();
+int8_t os_notify_from_isr(uint8_t pid, uint8_t bits) {
+    if (pid >= NUMBER_OF_PROCESSES || pcb[pid].running == 0) {
+        return -1;
+    }
+    ENTER_CRITICAL_SECTION();
+    if (os_notify_set(pid, bits)) {
+        switch_pending = 1;
+    }
+    LEAVE_CRITICAL_SECTION();
+    return 0;
+}
+
+uint8_t os_notify_wait(uint8_t bits, uint8_t mode, uint32_t ticks) {
+    uint8_t pid = os_get_current_pid();
+    uint8_t all = mode == OS_NOTIFY_ALL;
+    ENTER_CRITICAL_SECTION();
+    uint8_t matched = os_notify_matched(pid, bits, all);
+    if (matched == 0 && ticks != 0 && bits != 0 && os_interrupt_nesting == 0) {
+        pcb[pid].notify_mask = bits;
+        pcb[pid].notify_all = all;
+        pcb[pid].block_timestamp = system_ticks;
+        if (ticks != OS_WAIT_FOREVER) {
+            os_delay_queue_insert(pid, ticks);
+            pcb[pid].delayed = 1;
+        }
+        os_update_ready(pid);
+        LEAVE_CRITICAL_SECTION();
+        os_yield();
+        ENTER_CRITICAL_SECTION_AGAIN();
+        matched = os_notify_matched(pid, bits, all);
+    }
+    pcb[pid].notify_bits &= ~matched;
+    LEAVE_CRITICAL_SECTION();
+    return matched;
+}
+
+#define QUEUE_SLOT_FREE 0
+#define QUEUE_SLOT_RESERVED 1
+#define QUEUE_SLOT_COMMITTED 2
+
+void os_queue_init(os_queue *queue, void *storage, uint8_t message_size, uint8_t capacity) {
+    uint8_t slot;
+    queue->storage = storage;
+    queue->slot_size = message_size + 1;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->commit = 0;
+    queue->tail = 0;
+    queue->reserved = 0;
+    for (slot = 0; slot < capacity; slot++) {
+        queue->storage[slot * queue->slot_size] = QUEUE_SLOT_FREE;
+    }
+    os_semaphore_init(&queue->messages, 0);
+    os_semaphore_init(&queue->slots, capacity);
+}
+
+void *os_queue_reserve(os_queue *queue, uint32_t ticks) {
+    if (os_semaphore_wait_timeout(&queue->slots, ticks) != 0) {
+        return 0;
+    }
+    ENTER_CRITICAL_SECTION();
+    uint8_t *slot = &queue->storage[queue->tail * queue->slot_size];
+    *slot = QUEUE_SLOT_RESERVED;
+    if (++queue->tail == queue->capacity) {
+        queue->tail = 0;
+    }
+    queue->reserved++;
+    LEAVE_CRITICAL_SECTION();
+    return slot + 1;
+}
+
+void os_queue_commit(os_queue *queue, void *message) {
+    uint8_t ready = 0;
+    ENTER_CRITICAL_SECTION();
+    ((uint8_t *) message)[-1] = QUEUE_SLOT_COMMITTED;
+    // Publish the run of committed slots from the oldest reservation on
+    while (queue->reserved > 0 && queue->storage[queue->commit * queue->slot_size] == QUEUE_SLOT_COMMITTED) {
+        if (++queue->commit == queue->capacity) {
+            queue->commit = 0;
         }
-        if (semaphore->count < 255) {
-            semaphore->count++;
-            LEAVE_CRITICAL_SECTION();
+        queue->reserved--;
+        ready++;
+    }
+    LEAVE_CRITICAL_SECTION();
+    while (ready-- > 0) {
+        os_semaphore_signal(&queue->messages);
+    }
+}
+
+int8_t os_queue_send(os_queue *queue, const void *message, uint32_t ticks) {
+    void *slot = os_queue_reserve(queue, ticks);
+    if (slot == 0) {
+        return -1;
+    }
+    memcpy(slot, message, queue->slot_size - 1);
+    os_queue_commit(queue, slot);
+    return 0;
+}
+
+int8_t os_queue_post(os_queue *queue, const void *message) {
+    return os_queue_send(queue, message, 0);
+}
+
+void *os_queue_acquire(os_queue *queue, uint32_t ticks) {
+    if (os_semaphore_wait_timeout(&queue->messages, ticks) != 0) {
+        return 0;
+    }
+    ENTER_CRITICAL_SECTION();
+    uint8_t *slot = &queue->storage[queue->head * queue->slot_size];
+    *slot = QUEUE_SLOT_FREE;
+    if (++queue->head == queue->capacity) {
+        queue->head = 0;
+    }
+    LEAVE_CRITICAL_SECTION();
+    return slot + 1;
+}
+
+void os_queue_release(os_queue *queue) {
+    os_semaphore_signal(&queue->slots);
+}
+
+uint8_t os_queue_count(os_queue *queue) {
+    uint8_t count;
+    ENTER_CRITICAL_SECTION();
+    count = queue->messages.count;
+    LEAVE_CRITICAL_SECTION();
+    return count;
+}
+
+int8_t os_queue_receive(os_queue *queue, void *message, uint32_t ticks) {
+    if (os_semaphore_wait_timeout(&queue->messages, ticks) != 0) {
+        return -1;
+    }
+    // Copied with interrupts off so that receivers finishing out of order
+    // never free a slot another is still reading
+    ENTER_CRITICAL_SECTION();
+    uint8_t *slot = &queue->storage[queue->head * queue->slot_size];
+    *slot = QUEUE_SLOT_FREE;
+    memcpy(message, slot + 1, queue->slot_size - 1);
+    if (++queue->head == queue->capacity) {
+        queue->head = 0;
+    }
+    LEAVE_CRITICAL_SECTION();
+    os_semaphore_signal(&queue->slots);
+    return 0;
+}
+
+/**
+ * Recompute priorities so that every mutex owner runs at the best priority
+ * of the tasks waiting on it, directly or through a chain of mutexes. Must
+ * be called with the scheduler locked. Mutexes are never touched by
+ * interrupts, so only moving each task between ready lists needs them off.
+ */
+static void os_mutex_apply_inheritance(void) {
+	uint8_t effective[NUMBER_OF_PROCESSES];
+	uint8_t pid, pass;
+
+	for (pid = 0; pid < NUMBER_OF_PROCESSES; pid++) {
+		effective[pid] = pcb[pid].base_priority;
+	}
+	// Each pass carries a priority one more link along a chain
+	for (pass = 0; pass < NUMBER_OF_PROCESSES; pass++) {
+		for (pid = 0; pid < NUMBER_OF_PROCESSES; pid++) {
+			if (pcb[pid].running == 1 && pcb[pid].blocked_mutex != 0) {
+				uint8_t owner = pcb[pid].blocked_mutex->owner;
+				if (effective[pid] < effective[owner]) {
+					effective[owner] = effective[pid];
+				}
+			}
+		}
+	}
+
+	for (pid = 0; pid < NUMBER_OF_PROCESSES; pid++) {
+		if (pcb[pid].running == 1 && pcb[pid].priority != effective[pid]) {
+			ENTER_CRITICAL_SECTION();
+			os_change_priority(pid, effective[pid]);
+			LEAVE_CRITICAL_SECTION();
+		}
+	}
+}
+
+void os_mutex_init(os_mutex *mutex) {
+    mutex->owner = 0xff;
+    mutex->count = 0;
+}
+
+int8_t os_mutex_lock(os_mutex *mutex) {
+    os_scheduler_lock();
+    uint8_t pid = os_get_current_pid();
+    if (mutex->owner == 0xff) {
+        mutex->owner = pid;
+        mutex->count = 1;
+        os_scheduler_unlock();
+        return 0;
+    }
+    if (mutex->owner == pid) {
+        if (mutex->count == 255) {
+            os_scheduler_unlock();
+            return -1;
+        }
+        mutex->count++;
+        os_scheduler_unlock();
+        return 0;
+    }
+    if (os_interrupt_nesting > 0) {
+        os_scheduler_unlock();
+        return -1;
+    }
+    ENTER_CRITICAL_SECTION();
+    pcb[pid].blocked_mutex = mutex;
+    pcb[pid].block_timestamp = system_ticks;
+    os_update_ready(pid);
+    LEAVE_CRITICAL_SECTION();
+    os_mutex_apply_inheritance();
+    // Ownership has been handed over by os_mutex_unlock when this returns
+    os_scheduler_unlock_and_yield();
+    return 0;
+}
+
+int8_t os_mutex_unlock(os_mutex *mutex) {
+    os_scheduler_lock();
+    uint8_t pid = os_get_current_pid();
+    if (mutex->owner != pid) {
+        os_scheduler_unlock();
+        return -1;
+    }
+    if (--mutex->count > 0) {
+        os_scheduler_unlock();
+        return 0;
+    }
+    uint8_t waiter, next_owner = 0xff;
+    // Effective priority, so a waiter that has itself inherited a higher
+    // priority through another mutex goes first
+    for (waiter = 0; waiter < NUMBER_OF_PROCESSES; waiter++) {
+        if (pcb[waiter].running == 1 && pcb[waiter].blocked_mutex == mutex &&
+                (next_owner == 0xff || pcb[waiter].priority < pcb[next_owner].priority)) {
+            next_owner = waiter;
+        }
+    }
+    mutex->owner = next_owner;
+    if (next_owner == 0xff) {
+        // Uncontended, so no priority can have been inherited through it
+        if (pcb[pid].priority == pcb[pid].base_priority) {
+            os_scheduler_unlock();
             return 0;
         }
+    } else {
+        mutex->count = 1;
+        ENTER_CRITICAL_SECTION();
+        pcb[next_owner].blocked_mutex = 0;
+        pcb[next_owner].stats.blocked_ticks += system_ticks - pcb[next_owner].block_timestamp;
+        os_update_ready(next_owner);
         LEAVE_CRITICAL_SECTION();
-        return -1;
+    }
+    os_mutex_apply_inheritance();
+    os_scheduler_unlock_and_yield();
+    return 0;
 }
 
-ISR(TIMER0_COMP_vect) {
+OS_ISR(TIMER0_COMP_vect) {
+	uint8_t preempt;
+
+	if (tick_hook) {
+		tick_hook();
+	}
+
+#if TICKLESS_IDLE
+	if (tickless_active) {
+#if OS_PROFILE
+		profile_tick_restart();
+#endif
+		// Only the idle task can be running, so no quantum to account for
+		preempt = os_tick_advance(TICKLESS_PERIOD_TICKS);
+		if (preempt || (delay_head != 0xff && pcb[delay_head].delay_ticks < TICKLESS_PERIOD_TICKS)) {
+			TCCR0 = TIMER_TICK_MODE;
+			tickless_active = 0;
+		}
+		if (preempt) {
+			quantum_ticks = 0;
+			switch_pending = 1;
+		}
+		return;
+	}
+#endif
+
+#if OS_PROFILE
+	profile_tick();
+#endif
+
 	quantum_ticks++;
-	system_ticks++;
+	// Only the head of the delta queue counts down; everything behind it
+	// whose delta is zero wakes on the same tick
+	preempt = os_tick_advance(1);
 
 	if (quantum_ticks >= QUANTUM_MILLISECOND_LENGTH) {
+		// Hand the processor to the next ready task of the same priority
+		uint8_t priority = pcb[current_process].priority;
+		if (ready_head[priority] == current_process) {
+			ready_head[priority] = pcb[current_process].next_ready;
+		}
+		preempt = 1;
+	}
+	if (preempt || switch_pending) {
 		quantum_ticks = 0;
-		schedule();
+		switch_pending = 1;
 	}
 }
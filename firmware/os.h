@@ -23,17 +23,80 @@
  */
 #define NUMBER_OF_PROCESSES 6
 
+#if NUMBER_OF_PROCESSES < 2 || NUMBER_OF_PROCESSES > 127
+#error "NUMBER_OF_PROCESSES must be between 2 and 127 to fit process IDs"
+#endif
+
+/**
+ * Number of priority levels, 0 being the highest. The init task runs at the
+ * second lowest and the idle task at the lowest. Tasks sharing a level take
+ * turns, one quantum each.
+ */
+#define NUMBER_OF_PRIORITIES 6
+
+#if NUMBER_OF_PRIORITIES < 2 || NUMBER_OF_PRIORITIES > 64
+#error "NUMBER_OF_PRIORITIES must be between 2 and 64 to fit the ready bitmap"
+#endif
+
+/**
+ * Instrumentation build: 1 to time every critical section and tick with
+ * Timer 1 and report over the USART, see profile.h. Set by "make profile".
+ */
+#ifndef OS_PROFILE
+#define OS_PROFILE 0
+#endif
+
 /**
  * Length of each time quantum (ms)
  */
 #define QUANTUM_MILLISECOND_LENGTH 10
 
+/**
+ * Tickless idle: 1 to let the timer run at one interrupt per
+ * TICKLESS_PERIOD_TICKS while only the idle task is runnable, 0 for a fixed
+ * 1 ms tick. Can be set with "make DEFINES=-DTICKLESS_IDLE=1".
+ */
+#ifndef TICKLESS_IDLE
+#define TICKLESS_IDLE 0
+#endif
+
+/**
+ * Ticks per timer interrupt in tickless idle (fixed by the clk/1024 prescaler)
+ */
+#define TICKLESS_PERIOD_TICKS 16
+
 #define NAME_SIZE 5
 
 /**
- * Stack size
+ * Stack budget. An interrupt can land on any task, so every stack needs
+ * room for an OS_ISR frame on top of the task's own calls: the return
+ * address, the 32 registers and SREG saved by SAVE_CONTEXT, the frame tag,
+ * and OS_ISR_BODY_STACK for the handler body and the kernel calls it makes.
+ * The task itself gets at least OS_TASK_CALL_STACK below the return into
+ * os_terminate_current_task, which also covers its initial frame.
  */
-#define IDLE_TASK_STACK_SIZE 64
+#define OS_CONTEXT_SIZE 33
+#define OS_ISR_BODY_STACK 24
+#define OS_ISR_FRAME_SIZE (2 + OS_CONTEXT_SIZE + 1 + OS_ISR_BODY_STACK)
+#define OS_TASK_CALL_STACK 16
+
+/**
+ * Smallest stack a task can be given: the canary, the terminate return
+ * address, OS_TASK_CALL_STACK and an OS_ISR frame, 82 bytes
+ */
+#define MINIMUM_STACK_SIZE (STACK_CANARY_SIZE + 2 + OS_TASK_CALL_STACK + OS_ISR_FRAME_SIZE)
+
+/**
+ * Stack size of the idle task, which only makes short kernel calls
+ */
+#define IDLE_TASK_STACK_SIZE MINIMUM_STACK_SIZE
+
+/**
+ * Byte pattern task stacks are painted with, and number of bytes at the
+ * bottom of each stack that must keep it
+ */
+#define STACK_PAINT 0xa5
+#define STACK_CANARY_SIZE 4
 
 /**
  * Semaphore structure
@@ -44,6 +107,58 @@ typedef struct {
     uint8_t wait_list[NUMBER_OF_PROCESSES];
 } os_semaphore;
 
+/**
+ * Mutex structure
+ *
+ * Lock owned by a single task, which may lock it again recursively. While
+ * a higher-priority task waits on it, the owner runs at that priority.
+ */
+
+typedef struct {
+    uint8_t owner;
+    uint8_t count;
+} os_mutex;
+
+/**
+ * Message queue structure
+ *
+ * Fixed-size messages in caller-supplied storage of
+ * OS_QUEUE_STORAGE_SIZE(message_size, capacity) bytes. Every slot starts
+ * with a state byte, so messages committed out of order are only received
+ * once every slot before them is committed.
+ */
+
+#define OS_QUEUE_STORAGE_SIZE(message_size, capacity) (((message_size) + 1) * (capacity))
+
+typedef struct {
+    uint8_t *storage;
+    uint8_t slot_size;
+    uint8_t capacity;
+    uint8_t head; // Oldest message not yet received
+    uint8_t commit; // Oldest slot not yet committed
+    uint8_t tail; // Next slot to reserve
+    uint8_t reserved; // Slots from commit to tail
+    os_semaphore messages;
+    os_semaphore slots;
+} os_queue;
+
+/**
+ * Timeout for waits that never time out
+ */
+#define OS_WAIT_FOREVER 0xffffffff
+
+/**
+ * Per-task runtime statistics
+ */
+
+typedef struct {
+    uint32_t run_ticks; // Ticks during which the task was running
+    uint32_t blocked_ticks; // Ticks spent waiting on semaphores and mutexes
+    uint32_t switches_in; // Times the task was switched to
+    uint32_t voluntary_switches; // Switches away after blocking, delaying or suspending
+    uint32_t preempted_switches; // Switches away while still ready
+} os_task_stats;
+
 /* Naked functions and interrupts */
 
 #define NAKED_ISR(vector) \
@@ -134,11 +249,109 @@ typedef struct {
 		"pop r0 \n\t" \
 	)
 
+/**
+ * Frame left by os_yield: SREG and the call-saved registers only
+ */
+#define SAVE_YIELD_CONTEXT() \
+	asm volatile ( \
+		"in r0, __SREG__ \n\t" \
+		"cli \n\t" \
+		"push r0 \n\t" \
+		"push r2 \n\t" \
+		"push r3 \n\t" \
+		"push r4 \n\t" \
+		"push r5 \n\t" \
+		"push r6 \n\t" \
+		"push r7 \n\t" \
+		"push r8 \n\t" \
+		"push r9 \n\t" \
+		"push r10 \n\t" \
+		"push r11 \n\t" \
+		"push r12 \n\t" \
+		"push r13 \n\t" \
+		"push r14 \n\t" \
+		"push r15 \n\t" \
+		"push r16 \n\t" \
+		"push r17 \n\t" \
+		"push r28 \n\t" \
+		"push r29 \n\t" \
+	)
+
+#define RESTORE_YIELD_CONTEXT() \
+	asm volatile ( \
+		"pop r29 \n\t" \
+		"pop r28 \n\t" \
+		"pop r17 \n\t" \
+		"pop r16 \n\t" \
+		"pop r15 \n\t" \
+		"pop r14 \n\t" \
+		"pop r13 \n\t" \
+		"pop r12 \n\t" \
+		"pop r11 \n\t" \
+		"pop r10 \n\t" \
+		"pop r9 \n\t" \
+		"pop r8 \n\t" \
+		"pop r7 \n\t" \
+		"pop r6 \n\t" \
+		"pop r5 \n\t" \
+		"pop r4 \n\t" \
+		"pop r3 \n\t" \
+		"pop r2 \n\t" \
+		"pop r0 \n\t" \
+		"out __SREG__, r0 \n\t" \
+	)
+
+/**
+ * Tag pushed on top of every saved task frame, telling the switch which
+ * kind of frame to restore
+ */
+#define OS_FRAME_FULL 0
+#define OS_FRAME_YIELD 1
+#define OS_FRAME_INTERRUPT 2
+
+extern volatile uint8_t os_interrupt_nesting;
+
+void os_isr_exit(void);
+
+/**
+ * Interrupt handler that may wake tasks. The interrupted task's registers
+ * are saved once on entry, the body runs as an ordinary function, and a
+ * switch the body made pending happens on the way out by restoring the
+ * next task's frame instead of returning. Kernel calls in the body never
+ * switch from inside it.
+ */
+#define OS_ISR(vector) \
+	void vector##_body(void) __attribute__ ((noinline, used)); \
+	NAKED_ISR(vector) { \
+		SAVE_CONTEXT(); \
+		os_interrupt_nesting++; \
+		vector##_body(); \
+		asm volatile("jmp os_isr_exit"); \
+	} \
+	void vector##_body(void)
+
 #define LEAVE_NAKED_ISR() asm("reti");
 #define LEAVE_NAKED_FUNCTION() asm("reti");
 
 /* Critical sections */
 
+#if OS_PROFILE
+#include "profile.h"
+
+#define ENTER_CRITICAL_SECTION() \
+	uint8_t flags = SREG; \
+	asm volatile ("cli"); \
+	profile_enter(flags, __FILE__, __LINE__);
+
+#define ENTER_CRITICAL_SECTION_AGAIN() \
+	flags = SREG; \
+	asm volatile ("cli"); \
+	profile_enter(flags, __FILE__, __LINE__);
+
+#define LEAVE_CRITICAL_SECTION() \
+	profile_leave(flags); \
+	SREG = flags;
+#else
 #define ENTER_CRITICAL_SECTION() \
 	uint8_t flags = SREG; \
 	asm volatile ("cli");
@@ -149,6 +362,7 @@ typedef struct {
 	
 #define LEAVE_CRITICAL_SECTION() \
 	SREG = flags;
+#endif
 
 /* Stack */
 
@@ -169,13 +383,32 @@ void os_init(void);
  */
 void os_start_ticker(void);
 
+/**
+ * Save the current task and switch to the highest-priority ready task
+ */
+void schedule(void);
+
+/**
+ * Same as schedule, but only saves what a C function call must preserve.
+ * Use from task code only. Called from an OS_ISR body it just pends the
+ * switch until the handler exits.
+ */
+void os_yield(void);
+
 /**
  * Add new task to operating system
+ * @param task Task entry point
+ * @param stack Lowest address of the task's stack
+ * @param stack_size Size of the stack in bytes
+ * @param priority Priority, lower is more urgent
+ * @param name Task name
+ * @return Process ID or -1 on error
  */
-int8_t os_add_task(void (*task)(void), volatile uint8_t *stack, uint8_t priority, char *name);
+int8_t os_add_task(void (*task)(void), volatile uint8_t *stack, uint16_t stack_size, uint8_t priority, char *name);
 
 /**
  * Remove a task from the operating system
+ * @return Error code, -1 for a bad PID or the idle task
  */
 int8_t os_remove_task(uint8_t pid);
 
@@ -184,6 +417,27 @@ int8_t os_remove_task(uint8_t pid);
  */
 uint8_t os_get_current_pid(void);
 
+/**
+ * Keep other tasks from preempting the current one without disabling
+ * interrupts. Interrupts still run and may wake tasks, but any switch they
+ * cause waits until the matching os_scheduler_unlock. Calls nest. The
+ * current task must not block while holding the lock.
+ */
+void os_scheduler_lock(void);
+
+/**
+ * Undo one os_scheduler_lock, switching to a task woken meanwhile once the
+ * outermost lock is released
+ */
+void os_scheduler_unlock(void);
+
+/**
+ * Get time since the ticker started
+ *
+ * @return Number of ticks elapsed
+ */
+uint32_t os_get_ticks(void);
+
 void copy_string(char *destination, uint8_t destination_size, char *source);
 
 /**
@@ -207,6 +461,48 @@ char *os_get_task_name(uint8_t pid);
 int8_t os_set_task_priority(uint8_t pid, uint8_t priority);
 int8_t os_get_task_priority(uint8_t pid);
 
+/**
+ * Copy the runtime statistics of a task
+ * @param pid Process ID to read
+ * @param stats Destination for the statistics
+ * @return Error code
+ */
+int8_t os_get_task_stats(uint8_t pid, os_task_stats *stats);
+
+/**
+ * Share of all ticks so far spent in the idle task
+ * @return Idle time in percent
+ */
+uint8_t os_get_idle_percentage(void);
+
+/**
+ * Deepest stack use of a task so far
+ * @param pid Process ID to check
+ * @return Bytes of the stack that have been written
+ */
+uint16_t os_get_stack_high_water(uint8_t pid);
+
+/**
+ * Set the function called from the scheduler, with interrupts disabled, when
+ * a task is found to have overflowed its stack. The task is removed after
+ * the hook returns; an overflow of the idle task halts with interrupts off
+ * instead.
+ */
+void os_set_stack_overflow_hook(void (*hook)(uint8_t pid));
+
+/**
+ * Set a function called at the start of every tick interrupt, once per
+ * stretched period during tickless idle, for periodic work that needs no
+ * wakeups of its own. It runs in an OS_ISR, so it may use the _from_isr
+ * calls and must be short.
+ */
+void os_set_tick_hook(void (*hook)(void));
+
+/**
+ * Keep a task from running until os_resume_task
+ * @param pid Process ID to suspend
+ * @return Error code, -1 for a bad PID or the idle task
+ */
 int8_t os_suspend_task(uint8_t pid);
 int8_t os_resume_task(uint8_t pid);
 
@@ -214,4 +510,129 @@ void os_semaphore_init(os_semaphore *semaphore, uint8_t count);
 int8_t os_semaphore_wait(os_semaphore *semaphore);
 int8_t os_semaphore_signal(os_semaphore *semaphore);
 
+/**
+ * Wait on a semaphore for at most a number of ticks
+ * @param ticks Ticks to wait, 0 to only try, OS_WAIT_FOREVER to block;
+ * treated as 0 in an interrupt handler
+ * @return 0 once the semaphore is taken, -1 on timeout
+ */
+int8_t os_semaphore_wait_timeout(os_semaphore *semaphore, uint32_t ticks);
+
+/**
+ * Wait modes for notifications
+ */
+#define OS_NOTIFY_ANY 0
+#define OS_NOTIFY_ALL 1
+
+/**
+ * Set notification bits of a task, switching to it at once if that ends
+ * its wait and it outranks the caller
+ * @param pid Process ID to notify
+ * @param bits Bits to set
+ * @return Error code
+ */
+int8_t os_notify(uint8_t pid, uint8_t bits);
+
+/**
+ * Set notification bits of a task from an interrupt. A task woken this way
+ * runs on exit from an OS_ISR handler; from any other handler it runs at
+ * the next tick, or as soon as the interrupt returns to the idle task.
+ * @param pid Process ID to notify
+ * @param bits Bits to set
+ * @return Error code
+ */
+int8_t os_notify_from_isr(uint8_t pid, uint8_t bits);
+
+/**
+ * Wait for notification bits of the current task and clear the ones that
+ * ended the wait
+ * @param bits Bits to wait for
+ * @param mode OS_NOTIFY_ANY or OS_NOTIFY_ALL
+ * @param ticks Ticks to wait, 0 to only check, OS_WAIT_FOREVER to block;
+ * treated as 0 in an interrupt handler
+ * @return Bits received, 0 on timeout
+ */
+uint8_t os_notify_wait(uint8_t bits, uint8_t mode, uint32_t ticks);
+
+/**
+ * Initialize an empty message queue
+ * @param storage OS_QUEUE_STORAGE_SIZE(message_size, capacity) bytes
+ * @param message_size Bytes per message
+ * @param capacity Number of messages, at most 255
+ */
+void os_queue_init(os_queue *queue, void *storage, uint8_t message_size, uint8_t capacity);
+
+/**
+ * Reserve the next free slot to fill in place. Safe from interrupts with a
+ * timeout of 0.
+ * @param ticks Ticks to wait for a free slot, 0 or OS_WAIT_FOREVER as for
+ * semaphores
+ * @return Pointer to message_size bytes, 0 on timeout
+ */
+void *os_queue_reserve(os_queue *queue, uint32_t ticks);
+
+/**
+ * Make a reserved slot available to receivers. Safe from interrupts.
+ * @param message Pointer returned by os_queue_reserve
+ */
+void os_queue_commit(os_queue *queue, void *message);
+
+/**
+ * Copy a message into the queue
+ * @param ticks Ticks to wait for a free slot
+ * @return 0 on success, -1 on timeout
+ */
+int8_t os_queue_send(os_queue *queue, const void *message, uint32_t ticks);
+
+/**
+ * Copy a message into the queue without blocking, for interrupts
+ * @return 0 on success, -1 if the queue is full
+ */
+int8_t os_queue_post(os_queue *queue, const void *message);
+
+/**
+ * Take the oldest message in place. Slots taken this way must be released
+ * in the order they were taken.
+ * @param ticks Ticks to wait for a message
+ * @return Pointer to the message, 0 on timeout
+ */
+void *os_queue_acquire(os_queue *queue, uint32_t ticks);
+
+/**
+ * Give back the oldest slot taken with os_queue_acquire
+ */
+void os_queue_release(os_queue *queue);
+
+/**
+ * Copy the oldest message out of the queue
+ * @param ticks Ticks to wait for a message
+ * @return 0 on success, -1 on timeout
+ */
+int8_t os_queue_receive(os_queue *queue, void *message, uint32_t ticks);
+
+/**
+ * Get the number of committed messages waiting to be received
+ * @return Messages in the queue
+ */
+uint8_t os_queue_count(os_queue *queue);
+
+/**
+ * Initialize a mutex as unlocked
+ */
+void os_mutex_init(os_mutex *mutex);
+
+/**
+ * Lock a mutex, blocking until it is free. The owner inherits the priority
+ * of the highest-priority waiter until it unlocks.
+ * @return Error code, -1 if it would block in an interrupt handler
+ */
+int8_t os_mutex_lock(os_mutex *mutex);
+
+/**
+ * Unlock a mutex held by the current task, passing it to the
+ * highest-priority waiter once the recursion count reaches zero
+ * @return Error code, -1 if the current task is not the owner
+ */
+int8_t os_mutex_unlock(os_mutex *mutex);
+
 #endif
@@ -0,0 +1,193 @@
+/**
+ * Profile
+ *
+ * Interrupts-disabled time and tick latency profiler
+ */
+
+#include "os.h"
+
+#if OS_PROFILE
+
+#include "usart.h"
+
+typedef struct {
+    const char *file;
+    uint16_t line;
+    uint16_t count;
+    uint16_t max;
+    uint32_t total;
+} profile_site;
+
+static profile_site sites[PROFILE_SITES];
+static uint16_t dropped;
+
+static const char *enter_file;
+static uint16_t enter_line;
+static uint16_t enter_time;
+static uint8_t enter_active = 0;
+
+static uint16_t tick_count;
+static uint16_t tick_latency_max;
+static uint16_t tick_interval_min;
+static uint16_t tick_interval_max;
+static uint16_t tick_last;
+static uint8_t tick_valid = 0;
+
+static void profile_clear(void) {
+    uint8_t i;
+    for (i = 0; i < PROFILE_SITES; i++) {
+        sites[i].file = 0;
+    }
+    dropped = 0;
+    tick_count = 0;
+    tick_latency_max = 0;
+    tick_interval_min = 0xffff;
+    tick_interval_max = 0;
+}
+
+/**
+ * Start Timer 1 and clear all figures
+ */
+void profile_init(void) {
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10); // Free running at clk/1
+    profile_clear();
+}
+
+/**
+ * Note the start of a critical section entered with interrupts enabled;
+ * nested sections and those in interrupt handlers are part of an outer one
+ */
+void profile_enter(uint8_t flags, const char *file, uint16_t line) {
+    if (!(flags & (1 << SREG_I))) {
+        return;
+    }
+    enter_time = TCNT1;
+    TIFR = (1 << TOV1);
+    enter_file = file;
+    enter_line = line;
+    enter_active = 1;
+}
+
+/**
+ * Time the critical section being left and add it to its call site
+ */
+void profile_leave(uint8_t flags) {
+    uint16_t cycles = TCNT1 - enter_time;
+    uint8_t i;
+    if (!(flags & (1 << SREG_I)) || !enter_active) {
+        return;
+    }
+    enter_active = 0;
+    // Timer 1 wrapped at least once, so the true figure is off the scale
+    if ((TIFR & (1 << TOV1)) && cycles < 0x8000) {
+        cycles = 0xffff;
+    }
+    for (i = 0; i < PROFILE_SITES; i++) {
+        if (sites[i].file == 0) {
+            sites[i].file = enter_file;
+            sites[i].line = enter_line;
+            sites[i].count = 0;
+            sites[i].max = 0;
+            sites[i].total = 0;
+        }
+        if (sites[i].file == enter_file && sites[i].line == enter_line) {
+            sites[i].count++;
+            sites[i].total += cycles;
+            if (cycles > sites[i].max) {
+                sites[i].max = cycles;
+            }
+            return;
+        }
+    }
+    dropped++;
+}
+
+/**
+ * Record how late this tick started and how far it was from the last one
+ */
+void profile_tick(void) {
+    uint16_t now = TCNT1;
+    // Timer 0 restarts from 0 on the compare match and counts every 64 cycles
+    uint16_t latency = (uint16_t) TCNT0 << 6;
+    tick_count++;
+    if (latency > tick_latency_max) {
+        tick_latency_max = latency;
+    }
+    if (tick_valid) {
+        uint16_t interval = now - tick_last;
+        if (interval < tick_interval_min) {
+            tick_interval_min = interval;
+        }
+        if (interval > tick_interval_max) {
+            tick_interval_max = interval;
+        }
+    }
+    tick_last = now;
+    tick_valid = 1;
+}
+
+void profile_tick_restart(void) {
+    tick_valid = 0;
+}
+
+static void profile_print_number(const char *label, uint32_t value) {
+    char digits[11], buffer[11];
+    uint8_t length = 0, i = 0;
+    do {
+        digits[length++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (length > 0) {
+        buffer[i++] = digits[--length];
+    }
+    buffer[i] = '\0';
+    usart_puts_P(label);
+    usart_puts(buffer);
+}
+
+/**
+ * Print and then clear all figures
+ */
+void profile_dump(void) {
+    profile_site site;
+    uint16_t count, latency_max, interval_min, interval_max, lost;
+    uint8_t i;
+
+    for (i = 0; i < PROFILE_SITES; i++) {
+        ENTER_CRITICAL_SECTION();
+        site = sites[i];
+        LEAVE_CRITICAL_SECTION();
+        if (site.file == 0) {
+            break;
+        }
+        usart_puts_P(PSTR("PROFILE cli "));
+        usart_puts((char *) site.file);
+        profile_print_number(PSTR(":"), site.line);
+        profile_print_number(PSTR(" n="), site.count);
+        profile_print_number(PSTR(" max="), site.max);
+        profile_print_number(PSTR(" total="), site.total);
+        usart_puts_P(PSTR("\r\n"));
+    }
+
+    ENTER_CRITICAL_SECTION();
+    count = tick_count;
+    latency_max = tick_latency_max;
+    interval_min = tick_interval_min;
+    interval_max = tick_interval_max;
+    lost = dropped;
+    profile_clear();
+    LEAVE_CRITICAL_SECTION();
+
+    profile_print_number(PSTR("PROFILE tick n="), count);
+    profile_print_number(PSTR(" latency_max="), latency_max);
+    profile_print_number(PSTR(" interval_min="), count > 1 ? interval_min : 0);
+    profile_print_number(PSTR(" interval_max="), interval_max);
+    usart_puts_P(PSTR("\r\n"));
+    if (lost > 0) {
+        profile_print_number(PSTR("PROFILE dropped n="), lost);
+        usart_puts_P(PSTR("\r\n"));
+    }
+}
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * Profile
+ *
+ * Instrumentation for the OS_PROFILE build ("make profile"). Timer 1 runs
+ * free at the CPU clock and times every outermost critical section, keyed
+ * by the file and line that entered it, and every 1 ms tick: how late its
+ * handler started after the compare match and how far the gap from the
+ * previous tick strayed from 16000 cycles. profile_dump prints the lot over
+ * the USART:
+ *
+ *     PROFILE cli <file>:<line> n=<sections> max=<cycles> total=<cycles>
+ *     PROFILE tick n=<ticks> latency_max=<cycles> interval_min=<cycles> interval_max=<cycles>
+ *
+ * Every figure includes about 25 cycles of the profiler's own work between
+ * the two Timer 1 reads. Looking up the call site happens after the second
+ * read, still with interrupts off, so each section also runs up to a few
+ * hundred cycles longer than in a normal build without that being counted.
+ */
+
+#ifndef PROFILE
+#define PROFILE
+
+#include <inttypes.h>
+
+/**
+ * Number of critical section call sites that can be told apart; later
+ * sites are only counted as dropped
+ */
+#define PROFILE_SITES 16
+
+/**
+ * Start Timer 1 and clear all figures
+ */
+void profile_init(void);
+
+/**
+ * Called by ENTER_CRITICAL_SECTION with interrupts already off
+ * @param flags SREG from before interrupts were disabled
+ * @param file Source file of the call site
+ * @param line Source line of the call site
+ */
+void profile_enter(uint8_t flags, const char *file, uint16_t line);
+
+/**
+ * Called by LEAVE_CRITICAL_SECTION before interrupts are restored
+ * @param flags SREG to be restored
+ */
+void profile_leave(uint8_t flags);
+
+/**
+ * Called at the start of every 1 ms tick handler
+ */
+void profile_tick(void);
+
+/**
+ * Called whenever tickless idle stretches the tick, from the tick handler
+ * or an early wakeup, so the next gap is not counted as jitter
+ */
+void profile_tick_restart(void);
+
+/**
+ * Print and then clear all figures. Uses the USART, so call it from a task
+ * after usart_init.
+ */
+void profile_dump(void);
+
+#endif
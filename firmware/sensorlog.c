@@ -0,0 +1,177 @@
+/**
+ * Sensor log
+ *
+ * Append-only sensor log on the 24LC256
+ */
+
+#include "sensorlog.h"
+#include "os.h"
+
+typedef struct {
+    uint16_t delta;
+    uint16_t light;
+    uint16_t temperature;
+} sensorlog_entry;
+
+static uint8_t queue_storage[OS_QUEUE_STORAGE_SIZE(sizeof(sensorlog_entry), SENSORLOG_QUEUE_SIZE)];
+static os_queue queue;
+static uint8_t queue_initialized = 0;
+static uint32_t last_timestamp = 0;
+
+static uint16_t next_slot;
+static uint16_t next_sequence;
+
+static uint8_t sensorlog_checksum(uint8_t *record) {
+    uint8_t i, sum = 0;
+    for (i = 0; i < SENSORLOG_RECORD_SIZE - 1; i++) {
+        sum += record[i];
+    }
+    // Inverted so that neither an erased nor a zeroed record checks out
+    return ~sum;
+}
+
+/**
+ * Read the sequence number stored in a slot
+ * @param sequence Filled in with the sequence number
+ * @return 1 if the slot holds a valid record, otherwise 0
+ */
+static uint8_t sensorlog_read_sequence(uint16_t slot, uint16_t *sequence) {
+    uint8_t record[SENSORLOG_RECORD_SIZE];
+    if (eeprom24lc256_read(slot * SENSORLOG_RECORD_SIZE, record, SENSORLOG_RECORD_SIZE) != 0) {
+        return 0;
+    }
+    if (record[SENSORLOG_RECORD_SIZE - 1] != sensorlog_checksum(record)) {
+        return 0;
+    }
+    *sequence = (uint16_t) record[0] << 8 | record[1];
+    return 1;
+}
+
+/**
+ * Find the write position. Slots before it were written on the current lap
+ * and carry the slot 0 sequence plus their index; slots from it on are
+ * either from the previous lap, whose sequences are SENSORLOG_RECORDS lower,
+ * or empty. That split is found in log2(SENSORLOG_RECORDS) reads, counting
+ * any slot that fails its checksum as past the split.
+ *
+ * A slot 0 that fails its checksum was torn by a power loss at the start of
+ * a lap, unless the device is blank. The search then takes its sequence from
+ * the first valid slot just past what that write could have covered, which
+ * is still from the previous lap, and resumes writing at slot 0.
+ */
+static void sensorlog_recover(void) {
+    uint16_t first_sequence, sequence;
+    uint16_t low = 1, high = SENSORLOG_RECORDS;
+
+    if (!sensorlog_read_sequence(0, &first_sequence)) {
+        next_slot = 0;
+        next_sequence = 0;
+        for (low = 1; low <= EEPROM24LC256_PAGE_SIZE / SENSORLOG_RECORD_SIZE; low++) {
+            if (sensorlog_read_sequence(low, &sequence)) {
+                next_sequence = sequence - low + SENSORLOG_RECORDS;
+                break;
+            }
+        }
+        return;
+    }
+    while (low < high) {
+        uint16_t middle = low + (high - low) / 2;
+        if (sensorlog_read_sequence(middle, &sequence) && sequence == (uint16_t) (first_sequence + middle)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    next_slot = low % SENSORLOG_RECORDS;
+    next_sequence = first_sequence + low;
+}
+
+static void sensorlog_init_queue(void) {
+    ENTER_CRITICAL_SECTION();
+    if (!queue_initialized) {
+        os_queue_init(&queue, queue_storage, sizeof(sensorlog_entry), SENSORLOG_QUEUE_SIZE);
+        queue_initialized = 1;
+    }
+    LEAVE_CRITICAL_SECTION();
+}
+
+/**
+ * Queue a pair of samples for logging without blocking, filling the queue
+ * slot in place
+ * @return 0 on success, -1 if the queue is full
+ */
+int8_t sensorlog_append(uint32_t timestamp, uint16_t light, uint16_t temperature) {
+    sensorlog_entry *entry;
+    uint32_t delta;
+    sensorlog_init_queue();
+    entry = os_queue_reserve(&queue, 0);
+    if (entry == 0) {
+        return -1;
+    }
+    ENTER_CRITICAL_SECTION();
+    delta = timestamp - last_timestamp;
+    last_timestamp = timestamp;
+    LEAVE_CRITICAL_SECTION();
+    entry->delta = delta > 0xffff ? 0xffff : delta;
+    entry->light = light;
+    entry->temperature = temperature;
+    os_queue_commit(&queue, entry);
+    return 0;
+}
+
+/**
+ * Pack a queued entry into the next slot and hand it to the EEPROM driver,
+ * which gathers consecutive records into page writes
+ */
+static void sensorlog_write(sensorlog_entry *entry) {
+    uint8_t record[SENSORLOG_RECORD_SIZE];
+    record[0] = next_sequence >> 8;
+    record[1] = next_sequence & 0xff;
+    record[2] = entry->delta >> 8;
+    record[3] = entry->delta & 0xff;
+    record[4] = (entry->light >> 4) & 0xff;
+    record[5] = (entry->light & 0x0f) << 4 | ((entry->temperature >> 8) & 0x0f);
+    record[6] = entry->temperature & 0xff;
+    record[7] = sensorlog_checksum(record);
+    eeprom24lc256_write(next_slot * SENSORLOG_RECORD_SIZE, record, SENSORLOG_RECORD_SIZE);
+    next_slot = (next_slot + 1) % SENSORLOG_RECORDS;
+    next_sequence++;
+}
+
+/**
+ * Recover the write position, then log queued records. A partial page is
+ * flushed once SENSORLOG_FLUSH_TICKS have passed since its first record and
+ * nothing more is queued, so records share page writes instead of each
+ * rewriting the page.
+ */
+void sensorlog_task(void) {
+    sensorlog_entry *entry;
+    uint32_t flush_deadline = 0, wait;
+    uint8_t buffered = 0;
+    sensorlog_init_queue();
+    sensorlog_recover();
+    while (1) {
+        wait = OS_WAIT_FOREVER;
+        if (buffered) {
+            int32_t remaining = (int32_t) (flush_deadline - os_get_ticks());
+            wait = remaining > 0 ? (uint32_t) remaining : 0;
+        }
+        entry = os_queue_acquire(&queue, wait);
+        if (entry != 0) {
+            sensorlog_write(entry);
+            os_queue_release(&queue);
+            if (next_slot % (EEPROM24LC256_PAGE_SIZE / SENSORLOG_RECORD_SIZE) == 0) {
+                // The driver wrote the page out as soon as it filled
+                buffered = 0;
+            } else if (!buffered) {
+                buffered = 1;
+                flush_deadline = os_get_ticks() + SENSORLOG_FLUSH_TICKS;
+            }
+        }
+        if (buffered && os_queue_count(&queue) == 0 &&
+                (int32_t) (os_get_ticks() - flush_deadline) >= 0) {
+            eeprom24lc256_flush();
+            buffered = 0;
+        }
+    }
+}
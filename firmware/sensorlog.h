@@ -0,0 +1,58 @@
+/**
+ * Sensor log
+ *
+ * Append-only log of sensor samples kept in the 24LC256 as a ring of fixed
+ * 8-byte records:
+ *
+ *     sequence (16 bits) | time since previous record, ms (16 bits) |
+ *     light (12 bits) | temperature (12 bits) | checksum (8 bits)
+ *
+ * Each record's sequence number is one more than the slot before it, so the
+ * write position is the first slot that breaks the run from slot 0 and is
+ * found at boot by binary search. Records are written round the whole
+ * device in order, spreading wear evenly over every page.
+ *
+ * A partial page is held in RAM until it fills or SENSORLOG_FLUSH_TICKS
+ * after its first record. Logging at least one record per
+ * SENSORLOG_FLUSH_TICKS / 8 writes each page once per lap; slower logging
+ * rewrites a page up to 8 times per lap. A power loss costs at most
+ * SENSORLOG_FLUSH_TICKS worth of records.
+ */
+
+#ifndef SENSORLOG
+#define SENSORLOG
+
+#include <inttypes.h>
+
+#include "eeprom24lc256.h"
+
+#define SENSORLOG_RECORD_SIZE 8
+#define SENSORLOG_RECORDS (EEPROM24LC256_SIZE / SENSORLOG_RECORD_SIZE)
+
+/**
+ * Records that can wait in RAM for the logging task
+ */
+#define SENSORLOG_QUEUE_SIZE 8
+
+/**
+ * Longest a partial page of records waits in RAM before it is written
+ */
+#define SENSORLOG_FLUSH_TICKS 10000
+
+/**
+ * Queue a pair of samples for logging without blocking, also from
+ * interrupts
+ * @param timestamp Time of the samples in ticks
+ * @param light Light sample, 12 bits
+ * @param temperature Temperature sample, 12 bits
+ * @return 0 on success, -1 if the queue is full and the samples were dropped
+ */
+int8_t sensorlog_append(uint32_t timestamp, uint16_t light, uint16_t temperature);
+
+/**
+ * Task that recovers the write position and then writes queued records to
+ * the EEPROM. Needs i2c_init and eeprom24lc256_init to have been called.
+ */
+void sensorlog_task(void);
+
+#endif
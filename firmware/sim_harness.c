@@ -0,0 +1,164 @@
+/**
+ * Simulation harness
+ *
+ * Runs the unmodified firmware image under simavr and reports kernel timing
+ * measured in CPU cycles: time from entering os_switch_context to the first
+ * instruction of the incoming task, latency from the Timer 0 compare match to
+ * its vector, and the share of CPU time each PID received. Saving the
+ * outgoing task's frame happens in schedule, os_yield or the OS_ISR prologue
+ * before the jump, and is not part of the switch figure.
+ *
+ * Built for the host by "make sim", which passes the address and size of
+ * os_switch_context and the address of current_process taken from avr-nm.
+ *
+ * Usage: sim_harness firmware.elf mcu frequency cycles switch switch_size current_process
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_irq.h>
+#include <sim_interrupts.h>
+
+#define TIMER0_COMP_VECTOR 10
+#define VECTOR_SIZE 4
+#define OPCODE_RET 0x9508
+#define OPCODE_RETI 0x9518
+#define MAX_PIDS 64
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} cycle_stat;
+
+static avr_cycle_count_t timer_pending_cycle = 0;
+static uint8_t timer_pending = 0;
+
+static void stat_add(cycle_stat *stat, uint64_t cycles) {
+    if (stat->count == 0 || cycles < stat->min) {
+        stat->min = cycles;
+    }
+    if (cycles > stat->max) {
+        stat->max = cycles;
+    }
+    stat->total += cycles;
+    stat->count++;
+}
+
+static void stat_print(const char *name, cycle_stat *stat) {
+    if (stat->count == 0) {
+        printf("%s count=0\n", name);
+        return;
+    }
+    printf("%s count=%llu min=%llu avg=%llu max=%llu\n", name,
+           (unsigned long long) stat->count, (unsigned long long) stat->min,
+           (unsigned long long) (stat->total / stat->count), (unsigned long long) stat->max);
+}
+
+static void timer_pending_notify(struct avr_irq_t *irq, uint32_t value, void *param) {
+    avr_t *avr = (avr_t *) param;
+    if (value && !timer_pending) {
+        timer_pending = 1;
+        timer_pending_cycle = avr->cycle;
+    }
+}
+
+static uint16_t opcode_at(avr_t *avr, avr_flashaddr_t pc) {
+    return avr->flash[pc] | (avr->flash[pc + 1] << 8);
+}
+
+int main(int argc, char *argv[]) {
+    elf_firmware_t firmware;
+    avr_t *avr;
+    cycle_stat switch_stat, latency_stat;
+    uint64_t pid_cycles[MAX_PIDS];
+    avr_cycle_count_t limit, last_cycle, switch_start = 0;
+    avr_flashaddr_t switch_address, switch_end, timer_vector;
+    uint16_t current_process_address;
+    uint8_t in_switch = 0, leaving_switch = 0;
+    int state, pid;
+
+    if (argc != 8) {
+        fprintf(stderr, "usage: %s firmware.elf mcu frequency cycles switch switch_size current_process\n", argv[0]);
+        return 1;
+    }
+
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[1], &firmware) != 0) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+    avr = avr_make_mcu_by_name(argv[2]);
+    if (!avr) {
+        fprintf(stderr, "unknown mcu %s\n", argv[2]);
+        return 1;
+    }
+    avr_init(avr);
+    firmware.frequency = strtoul(argv[3], NULL, 0);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = firmware.frequency;
+
+    limit = strtoull(argv[4], NULL, 0);
+    switch_address = strtoul(argv[5], NULL, 0);
+    switch_end = switch_address + strtoul(argv[6], NULL, 0);
+    current_process_address = strtoul(argv[7], NULL, 0) & 0xffff; // Strip 0x800000 data space offset
+    timer_vector = TIMER0_COMP_VECTOR * VECTOR_SIZE;
+
+    memset(&switch_stat, 0, sizeof(switch_stat));
+    memset(&latency_stat, 0, sizeof(latency_stat));
+    memset(pid_cycles, 0, sizeof(pid_cycles));
+
+    avr_irq_register_notify(avr_get_interrupt_irq(avr, TIMER0_COMP_VECTOR), timer_pending_notify, avr);
+
+    last_cycle = avr->cycle;
+    pid = avr->data[current_process_address];
+    while (avr->cycle < limit) {
+        avr_flashaddr_t pc = avr->pc;
+
+        if (leaving_switch) {
+            // First instruction after the switch's ret or reti, now in the next task
+            stat_add(&switch_stat, avr->cycle - switch_start);
+            leaving_switch = 0;
+        }
+        if (pc == switch_address) {
+            in_switch = 1;
+            switch_start = avr->cycle;
+        } else if (in_switch && pc > switch_address && pc < switch_end &&
+                   (opcode_at(avr, pc) == OPCODE_RET || opcode_at(avr, pc) == OPCODE_RETI)) {
+            in_switch = 0;
+            leaving_switch = 1;
+        }
+        if (pc == timer_vector && timer_pending) {
+            stat_add(&latency_stat, avr->cycle - timer_pending_cycle);
+            timer_pending = 0;
+        }
+
+        state = avr_run(avr);
+
+        pid_cycles[pid % MAX_PIDS] += avr->cycle - last_cycle;
+        last_cycle = avr->cycle;
+        pid = avr->data[current_process_address];
+
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "simulation stopped at cycle %llu\n", (unsigned long long) avr->cycle);
+            break;
+        }
+    }
+
+    printf("cycles=%llu frequency=%u\n", (unsigned long long) avr->cycle, (unsigned) avr->frequency);
+    stat_print("context_switch", &switch_stat);
+    stat_print("timer_isr_latency", &latency_stat);
+    for (pid = 0; pid < MAX_PIDS; pid++) {
+        if (pid_cycles[pid] > 0) {
+            printf("pid=%d cycles=%llu share=%.2f%%\n", pid, (unsigned long long) pid_cycles[pid],
+                   100.0 * pid_cycles[pid] / avr->cycle);
+        }
+    }
+    return 0;
+}
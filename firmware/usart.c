@@ -8,9 +8,27 @@
  */
 
 #include "usart.h"
+#include "os.h"
 
 volatile static uint8_t usart_is_initialized = 0;
 
+#define TX_BUFFER_MASK (USART_TX_BUFFER_SIZE - 1)
+#define RX_BUFFER_MASK (USART_RX_BUFFER_SIZE - 1)
+
+static volatile uint8_t tx_buffer[USART_TX_BUFFER_SIZE];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
+static volatile uint8_t rx_buffer[USART_RX_BUFFER_SIZE];
+static volatile uint8_t rx_head = 0;
+static volatile uint8_t rx_tail = 0;
+
+// Free slots in the transmit buffer and bytes waiting in the receive buffer
+static os_semaphore tx_space;
+static os_semaphore rx_available;
+// Signalled once per waiting usart_flush caller when the buffer runs dry
+static os_semaphore tx_drained;
+static volatile uint8_t tx_drain_waiters = 0;
+
 #define BAUD_HIGH ((207 & 0xff00) >> 8)
 #define BAUD_LOW (207 & 0x00ff)
 
@@ -22,13 +40,20 @@ volatile static uint8_t usart_is_initialized = 0;
   */
 void usart_init(uint8_t flags) {
 	UCSRB = 0;
+	tx_head = tx_tail = 0;
+	rx_head = rx_tail = 0;
+	os_semaphore_init(&tx_space, USART_TX_BUFFER_SIZE - 1);
+	os_semaphore_init(&rx_available, 0);
+	os_semaphore_init(&tx_drained, 0);
+	tx_drain_waiters = 0;
 	if (flags & USART_TRANSMIT) {
-		// Enable transmitting
+		// Enable transmitting, the data register empty interrupt is
+		// enabled whenever the transmit buffer has data
 		UCSRB |= (1 << TXEN);
 	}
 	if (flags & USART_RECEIVE) {
 		// Enable receiving with receive interrupts enabled
-		UCSRB |= ((0 << RXCIE) | (1 << RXEN));
+		UCSRB |= ((1 << RXCIE) | (1 << RXEN));
 	}
 	UCSRA = (1 << U2X);
 	UBRRH = (unsigned char) BAUD_HIGH;
@@ -38,15 +63,23 @@ void usart_init(uint8_t flags) {
 }
 
 /**
- * Send one byte over USART
+ * Queue one byte for sending over USART, sleeping while the buffer is full
  * @param data Data byte to transmit
+ * @return 0 once queued, -1 if the buffer is full and the caller cannot
+ * sleep, in which case the byte is dropped
  */
- // TODO: Error codes
-void usart_putc(char data) {
+int8_t usart_putc(char data) {
 	if (usart_is_initialized) {
-		while (!(UCSRA & (1 << UDRE)));
-		UDR = data;
+		if (os_semaphore_wait(&tx_space) != 0) {
+			return -1;
+		}
+		ENTER_CRITICAL_SECTION();
+		tx_buffer[tx_head] = data;
+		tx_head = (tx_head + 1) & TX_BUFFER_MASK;
+		UCSRB |= (1 << UDRIE);
+		LEAVE_CRITICAL_SECTION();
 	}
+	return 0;
 }
 
 /**
@@ -60,15 +93,45 @@ void usart_puts(char *string) {
 }
 
 /**
- * Receive one byte over USART
- * @param unused Unused file descriptor to enable stdio use
+ * Send string stored in program memory over USART
+ * @param string
+ */
+void usart_puts_P(const char *string) {
+    char data;
+    while ((data = pgm_read_byte(string++))) {
+        usart_putc(data);
+    }
+}
+
+/**
+ * Sleep until every queued byte has been handed to the transmitter, so no
+ * transmit interrupts are left to run
+ */
+void usart_flush(void) {
+	ENTER_CRITICAL_SECTION();
+	if (tx_head == tx_tail) {
+		LEAVE_CRITICAL_SECTION();
+		return;
+	}
+	tx_drain_waiters++;
+	LEAVE_CRITICAL_SECTION();
+	os_semaphore_wait(&tx_drained);
+}
+
+/**
+ * Receive one byte over USART, sleeping until one arrives
  * @return Byte from USART
  */
 // TODO: Error codes
 char usart_getc(void) {
 	if (usart_is_initialized) {
-		while (!(UCSRA & (1 << RXC)));
-		return UDR;
+		char data;
+		os_semaphore_wait(&rx_available);
+		ENTER_CRITICAL_SECTION();
+		data = rx_buffer[rx_tail];
+		rx_tail = (rx_tail + 1) & RX_BUFFER_MASK;
+		LEAVE_CRITICAL_SECTION();
+		return data;
 	}
 	return 0;
 }
@@ -79,7 +142,41 @@ char usart_getc(void) {
  */
 int usart_hasc(void) {
 	if (usart_is_initialized) {
-		return (UCSRA & (1 << RXC)) >> 1;
+		return (rx_head - rx_tail) & RX_BUFFER_MASK;
 	}
 	return 0;
 }
+
+/**
+ * Move the next buffered byte into the transmitter
+ */
+OS_ISR(USART_UDRE_vect) {
+	if (tx_head == tx_tail) {
+		UCSRB &= ~(1 << UDRIE);
+		return;
+	}
+	UDR = tx_buffer[tx_tail];
+	tx_tail = (tx_tail + 1) & TX_BUFFER_MASK;
+	if (tx_head == tx_tail) {
+		UCSRB &= ~(1 << UDRIE);
+		while (tx_drain_waiters > 0) {
+			tx_drain_waiters--;
+			os_semaphore_signal(&tx_drained);
+		}
+	}
+	os_semaphore_signal(&tx_space);
+}
+
+/**
+ * Buffer a received byte, dropping it if the buffer is full
+ */
+OS_ISR(USART_RXC_vect) {
+	uint8_t data = UDR;
+	uint8_t next_head = (rx_head + 1) & RX_BUFFER_MASK;
+	if (next_head == rx_tail) {
+		return;
+	}
+	rx_buffer[rx_head] = data;
+	rx_head = next_head;
+	os_semaphore_signal(&rx_available);
+}
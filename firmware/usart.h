@@ -13,6 +13,7 @@
 #include <inttypes.h>
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 
 /**
  * Enable transmitting
@@ -24,6 +25,13 @@
  */
 #define USART_RECEIVE 0x02
 
+/**
+ * Ring buffer sizes, must be powers of two no larger than 256. One slot of
+ * each is kept free to tell a full buffer from an empty one.
+ */
+#define USART_TX_BUFFER_SIZE 64
+#define USART_RX_BUFFER_SIZE 32
+
 /**
  * Initialize USART with specified baud rate and options
  * @param flags Flags for options for serial port
@@ -32,11 +40,12 @@
 void usart_init(uint8_t flags);
 
 /**
- * Send one byte over USART
+ * Queue one byte for sending over USART, sleeping while the buffer is full
  * @param data Data byte to transmit
- * @param unusued Unused file descriptor to enable stdio use
+ * @return 0 once queued, -1 if the buffer is full and the caller cannot
+ * sleep, in which case the byte is dropped
  */
-void usart_putc(char data);
+int8_t usart_putc(char data);
 
 /**
  * Send string over USART
@@ -45,8 +54,19 @@ void usart_putc(char data);
 void usart_puts(char *string);
 
 /**
- * Receive one byte over USART
- * @param unused Unused file descriptor to enable stdio use
+ * Send string stored in program memory over USART
+ * @param string
+ */
+void usart_puts_P(const char *string);
+
+/**
+ * Sleep until every queued byte has been handed to the transmitter, so no
+ * transmit interrupts are left to run. Task code only.
+ */
+void usart_flush(void);
+
+/**
+ * Receive one byte over USART, sleeping until one arrives
  * @return Byte from USART
  */
 char usart_getc(void); 